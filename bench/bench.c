@@ -0,0 +1,396 @@
+/*
+ * Latency and throughput of the query paths, called directly rather than
+ * through the command line:
+ *
+ *     dosiero_bench [-o out.json] [-n rounds] [-w warmup] [-s samples] [-t threads] <image>...
+ *
+ * For every image the tree is walked once to collect up to -s sample files
+ * and directories (spread evenly over the walk order).  Each operation then
+ * runs over its samples for -w warm-up rounds, which are not timed, and -n
+ * timed rounds; every call is timed on its own.  Results go to -o (default
+ * stdout) as JSON: per image and operation the sample count, latency
+ * percentiles in nanoseconds, calls per second and, for list and extract,
+ * bytes per second.
+ *
+ *   resolve          resolve_pathname(), no directory index
+ *   resolve-indexed  resolve_pathname() through the per-directory index
+ *   canonical-path   canonical_path() of a directory
+ *   reverse-map      canonical_path_mapped() through the parent map
+ *   list             list_tree() of a directory
+ *   extract          extract_file_to_stdout() of a file
+ *   concurrent       1, 2, 4, ... up to -t threads (default one per CPU)
+ *                    sharing the loaded image, each resolving every sample
+ *                    through the directory index and reading the first KB
+ *                    of the files with inode_pread(); calls per second for
+ *                    the whole run and the speedup over one thread
+ *
+ * dosiero.c is compiled into this file so its static functions can be
+ * called as they are; output goes to /dev/null.
+ */
+#include "dosiero.c"
+
+#include <time.h>
+
+#define BENCH_USAGE "Usage: %s [-o out.json] [-n rounds] [-w warmup] [-s samples] [-t threads] <image>...\n"
+
+typedef struct {
+    char **paths;              /* absolute */
+    uint32_t *inos;
+    size_t count, cap;
+} sample_set_t;
+
+typedef struct {
+    sample_set_t files, dirs;
+} samples_t;
+
+static int sample_add(sample_set_t *s, const char *rel, uint32_t ino) {
+    if (s->count == s->cap) {
+        size_t ncap = s->cap ? s->cap * 2 : 256;
+        char **np = realloc(s->paths, ncap * sizeof(char *));
+        if (!np) return -1;
+        s->paths = np;
+        uint32_t *ni = realloc(s->inos, ncap * sizeof(uint32_t));
+        if (!ni) return -1;
+        s->inos = ni;
+        s->cap = ncap;
+    }
+    size_t len = strlen(rel);
+    char *p = malloc(len + 2);
+    if (!p) return -1;
+    p[0] = '/';
+    memcpy(p + 1, rel, len + 1);
+    s->paths[s->count] = p;
+    s->inos[s->count++] = ino;
+    return 0;
+}
+
+/* Keep n entries, evenly spaced over the set */
+static void sample_thin(sample_set_t *s, size_t n) {
+    if (s->count <= n) return;
+    for (size_t i = 0; i < n; i++) {
+        size_t j = i * s->count / n;
+        char *keep = s->paths[j];
+        s->paths[j] = s->paths[i];
+        s->paths[i] = keep;
+        uint32_t ino = s->inos[j];
+        s->inos[j] = s->inos[i];
+        s->inos[i] = ino;
+    }
+    for (size_t i = n; i < s->count; i++) free(s->paths[i]);
+    s->count = n;
+}
+
+static void sample_free(sample_set_t *s) {
+    for (size_t i = 0; i < s->count; i++) free(s->paths[i]);
+    free(s->paths);
+    free(s->inos);
+}
+
+static int sample_visit(tree_walk_t *w, uint16_t ino, void *arg) {
+    samples_t *sm = arg;
+    if (ino > w->inode_count || !(inode_mode(w->inodes, ino) & 0100000)) return WALK_NEXT;
+    uint16_t fmt = inode_mode(w->inodes, ino) & 060000;
+    int r = 0;
+    if (fmt == 040000) r = sample_add(&sm->dirs, w->path, ino);
+    else if (fmt == 0) r = sample_add(&sm->files, w->path, ino);
+    if (r != 0) return WALK_STOP;
+    return fmt == 040000 ? WALK_DESCEND : WALK_NEXT;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Output of list goes through a stream that only counts bytes */
+static ssize_t count_write(void *cookie, const char *buf, size_t len) {
+    (void)buf;
+    *(uint64_t *)cookie += len;
+    return (ssize_t)len;
+}
+
+typedef struct {
+    fs_t *fs;
+    FILE *sink;                /* /dev/null, a real descriptor for extract */
+    FILE *counter;             /* counting stream for list */
+    uint64_t counted;
+    const sample_set_t *set;
+    uint64_t bytes;            /* output produced by the last call */
+} bench_ctx_t;
+
+typedef bool (*bench_fn)(bench_ctx_t *c, size_t i);
+
+static bool op_resolve(bench_ctx_t *c, size_t i) {
+    fs_t *fs = c->fs;
+    return resolve_pathname(fs->disk, fs->inodes, fs->inode_count, fs->dindex, c->set->paths[i],
+                            fs->inode_start_sector, fs->data_start, fs->data_end) == c->set->inos[i];
+}
+
+static bool op_canonical(bench_ctx_t *c, size_t i) {
+    fs_t *fs = c->fs;
+    char *p = canonical_path(fs->disk, fs->inodes, fs->inode_count, c->set->inos[i],
+                             fs->inode_start_sector, fs->data_start, fs->data_end);
+    free(p);
+    return p != NULL;
+}
+
+static bool op_reverse_map(bench_ctx_t *c, size_t i) {
+    bool fallback;
+    char *p = canonical_path_mapped(c->fs->pmap, c->fs->inodes, c->set->inos[i], &fallback);
+    free(p);
+    return p != NULL || fallback;
+}
+
+static bool op_list(bench_ctx_t *c, size_t i) {
+    fs_t *fs = c->fs;
+    uint64_t before = c->counted;
+    int r = list_tree(fs->disk, fs->inodes, fs->inode_count, c->set->inos[i], c->counter,
+                      fs->inode_start_sector, fs->data_start, fs->data_end);
+    fflush(c->counter);
+    c->bytes = c->counted - before;
+    return r == 0;
+}
+
+static bool op_extract(bench_ctx_t *c, size_t i) {
+    fs_t *fs = c->fs;
+    c->bytes = inode_size_bytes(inode_at(fs->inodes, c->set->inos[i]));
+    return extract_file_to_stdout(fs->disk, fs->inodes, fs->inode_count, c->set->inos[i], c->sink,
+                                  fs->inode_start_sector, fs->data_start, fs->data_end) == 0;
+}
+
+/* Run one operation over a sample set and write its JSON object */
+static int bench_op(FILE *json, bool first, const char *name, bench_fn fn, bench_ctx_t *c,
+                    int rounds, int warmup, bool with_bytes) {
+    size_t n = c->set->count;
+    uint64_t *lat = malloc((n * rounds + 1) * sizeof(uint64_t));
+    if (!lat) return -1;
+    size_t failures = 0, k = 0;
+    uint64_t total = 0, bytes = 0;
+    for (int r = 0; r < warmup; r++)
+        for (size_t i = 0; i < n; i++) fn(c, i);
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            c->bytes = 0;
+            uint64_t t0 = now_ns();
+            bool ok = fn(c, i);
+            uint64_t dt = now_ns() - t0;
+            failures += !ok;
+            lat[k++] = dt;
+            total += dt;
+            bytes += c->bytes;
+        }
+    }
+    qsort(lat, k, sizeof(uint64_t), cmp_u64);
+#define PCT(q) (k ? lat[(size_t)((q) * (k - 1) + 0.5)] : 0)
+    fprintf(json, "%s\n        { \"op\": \"%s\", \"samples\": %zu, \"calls\": %zu, \"failures\": %zu,\n"
+                  "          \"min_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu,\n"
+                  "          \"mean_ns\": %.1f, \"calls_per_sec\": %.1f",
+            first ? "" : ",", name, n, k, failures,
+            (unsigned long long)PCT(0), (unsigned long long)PCT(0.5), (unsigned long long)PCT(0.9),
+            (unsigned long long)PCT(0.99), (unsigned long long)PCT(1),
+            k ? (double)total / k : 0, total ? k * 1e9 / total : 0);
+#undef PCT
+    if (with_bytes) fprintf(json, ", \"bytes_per_sec\": %.1f", total ? bytes * 1e9 / total : 0);
+    fprintf(json, " }");
+    free(lat);
+    return 0;
+}
+
+/* One thread of the concurrent run */
+typedef struct {
+    fs_t *fs;
+    const sample_set_t *set;
+    int rounds;
+    size_t calls, failures;
+} concurrent_arg_t;
+
+static void *concurrent_worker(void *arg) {
+    concurrent_arg_t *a = arg;
+    fs_t *fs = a->fs;
+    unsigned char buf[1024];
+    for (int r = 0; r < a->rounds; r++) {
+        for (size_t i = 0; i < a->set->count; i++) {
+            uint32_t ino = resolve_pathname(fs->disk, fs->inodes, fs->inode_count, fs->dindex,
+                                            a->set->paths[i], fs->inode_start_sector,
+                                            fs->data_start, fs->data_end);
+            a->calls++;
+            if (ino != a->set->inos[i]) { a->failures++; continue; }
+            if ((inode_mode(fs->inodes, ino) & 060000) == 0 &&
+                inode_pread(fs->disk, inode_at(fs->inodes, ino), buf, sizeof(buf), 0,
+                            fs->data_start, fs->data_end) < 0)
+                a->failures++;
+        }
+    }
+    return NULL;
+}
+
+/* Write one "concurrent" object per thread count */
+static void bench_concurrent(FILE *json, fs_t *fs, const sample_set_t *set, int rounds, int maxthreads) {
+    concurrent_arg_t args[MAX_WORKER_THREADS];
+    pthread_t tids[MAX_WORKER_THREADS];
+    double base = 0;
+    for (int n = 1; ; n = n * 2 > maxthreads ? maxthreads : n * 2) {
+        int started = 0;
+        uint64_t t0 = now_ns();
+        for (; started < n; started++) {
+            args[started] = (concurrent_arg_t){ fs, set, rounds, 0, 0 };
+            if (pthread_create(&tids[started], NULL, concurrent_worker, &args[started]) != 0) break;
+        }
+        size_t calls = 0, failures = 0;
+        for (int t = 0; t < started; t++) {
+            pthread_join(tids[t], NULL);
+            calls += args[t].calls;
+            failures += args[t].failures;
+        }
+        uint64_t dt = now_ns() - t0;
+        double rate = dt ? calls * 1e9 / dt : 0;
+        if (n == 1) base = rate;
+        fprintf(json, ",\n        { \"op\": \"concurrent\", \"threads\": %d, \"samples\": %zu, \"calls\": %zu, "
+                      "\"failures\": %zu,\n          \"calls_per_sec\": %.1f, \"speedup\": %.2f }",
+                started, set->count, calls, failures, rate, base > 0 ? rate / base : 0);
+        if (n == maxthreads) break;
+    }
+}
+
+static void json_string(FILE *json, const char *s) {
+    fputc('"', json);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(json, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(json, "\\u%04x", (unsigned char)*s);
+        else fputc(*s, json);
+    }
+    fputc('"', json);
+}
+
+static int bench_image(FILE *json, bool first, const char *path, FILE *sink,
+                       int rounds, int warmup, size_t nsamples, int maxthreads) {
+    fs_t *fs = fs_open(path);
+    if (!fs) return -1;
+    samples_t sm;
+    memset(&sm, 0, sizeof(sm));
+    tree_walk_t w;
+    tree_walk_init(&w, fs->disk, fs->inodes, fs->inode_count, fs->data_start, fs->data_end);
+    int r = tree_walk(&w, 1, 0, sample_visit, &sm);
+    tree_walk_free(&w);
+    if (r != 0 || sample_add(&sm.dirs, "", 1) != 0) {
+        fprintf(stderr, "Error: Unable to walk '%s'\n", path);
+        sample_free(&sm.files);
+        sample_free(&sm.dirs);
+        fs_close(fs);
+        return -1;
+    }
+    size_t nfiles = sm.files.count, ndirs = sm.dirs.count;
+    sample_thin(&sm.files, nsamples);
+    sample_thin(&sm.dirs, nsamples);
+
+    /* resolve mixes files and directories */
+    sample_set_t all;
+    memset(&all, 0, sizeof(all));
+    for (size_t i = 0; i < sm.files.count && r == 0; i++) r = sample_add(&all, sm.files.paths[i] + 1, sm.files.inos[i]);
+    for (size_t i = 0; i < sm.dirs.count && r == 0; i++) r = sample_add(&all, sm.dirs.paths[i] + 1, sm.dirs.inos[i]);
+    bench_ctx_t c = { fs, sink, NULL, 0, &all, 0 };
+    c.counter = fopencookie(&c.counted, "w", (cookie_io_functions_t){ .write = count_write });
+    if (r != 0 || !c.counter) {
+        if (c.counter) fclose(c.counter);
+        sample_free(&all);
+        sample_free(&sm.files);
+        sample_free(&sm.dirs);
+        fs_close(fs);
+        return -1;
+    }
+
+    fprintf(json, "%s\n    { \"image\": ", first ? "" : ",");
+    json_string(json, path);
+    fprintf(json, ", \"backend\": \"%s\", \"inodes\": %u, \"files\": %zu, \"directories\": %zu,\n"
+                  "      \"results\": [",
+            fs->disk->base ? (fs->disk->mapped ? "mmap" : "memory") : "pread",
+            (unsigned)fs->inode_count, nfiles, ndirs);
+    bench_op(json, true, "resolve", op_resolve, &c, rounds, warmup, false);
+    fs->dindex = dir_index_new(fs->inode_count);
+    if (fs->dindex) bench_op(json, false, "resolve-indexed", op_resolve, &c, rounds, warmup, false);
+    c.set = &sm.dirs;
+    bench_op(json, false, "canonical-path", op_canonical, &c, rounds, warmup, false);
+    fs->pmap = parent_map_build(fs->disk, fs->inodes, fs->inode_count, fs->data_start, fs->data_end);
+    if (fs->pmap) bench_op(json, false, "reverse-map", op_reverse_map, &c, rounds, warmup, false);
+    bench_op(json, false, "list", op_list, &c, rounds, warmup, true);
+    c.set = &sm.files;
+    bench_op(json, false, "extract", op_extract, &c, rounds, warmup, true);
+    if (fs->dindex) bench_concurrent(json, fs, &all, rounds, maxthreads);
+    fprintf(json, "\n      ] }");
+
+    fclose(c.counter);
+    sample_free(&all);
+    sample_free(&sm.files);
+    sample_free(&sm.dirs);
+    fs_close(fs);
+    return 0;
+}
+
+static bool parse_count(const char *s, long lo, long *out) {
+    char *end;
+    if (!s || *s == '\0') return false;
+    long v = strtol(s, &end, 10);
+    if (*end != '\0' || v < lo) return false;
+    *out = v;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const char *outpath = NULL;
+    long rounds = 5, warmup = 1, nsamples = 1000, threads = worker_threads();
+    int first_image = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok;
+        if (a[0] != '-') {
+            first_image = i;
+            break;
+        }
+        if (strcmp(a, "-o") == 0) ok = (outpath = v) != NULL;
+        else if (strcmp(a, "-n") == 0) ok = parse_count(v, 1, &rounds);
+        else if (strcmp(a, "-w") == 0) ok = parse_count(v, 0, &warmup);
+        else if (strcmp(a, "-s") == 0) ok = parse_count(v, 1, &nsamples);
+        else if (strcmp(a, "-t") == 0) ok = parse_count(v, 1, &threads) && threads <= MAX_WORKER_THREADS;
+        else ok = false;
+        if (!ok) {
+            fprintf(stderr, BENCH_USAGE, argv[0]);
+            return EXIT_FAILURE;
+        }
+        i++;
+    }
+    if (!first_image) {
+        fprintf(stderr, BENCH_USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *json = outpath ? fopen(outpath, "w") : stdout;
+    FILE *sink = fopen("/dev/null", "w");
+    if (!json || !sink) {
+        fprintf(stderr, "Error: Unable to open '%s'\n", !json ? outpath : "/dev/null");
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    fprintf(json, "{ \"rounds\": %ld, \"warmup\": %ld, \"max_samples\": %ld, \"max_threads\": %ld,\n  \"images\": [",
+            rounds, warmup, nsamples, threads);
+    bool first = true;
+    for (int i = first_image; i < argc; i++) {
+        if (bench_image(json, first, argv[i], sink, (int)rounds, (int)warmup, (size_t)nsamples,
+                        (int)threads) != 0) {
+            fprintf(stderr, "Error: Unable to benchmark '%s'\n", argv[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        first = false;
+    }
+    fprintf(json, "\n  ] }\n");
+    fclose(sink);
+    if (json != stdout && fclose(json) != 0) status = EXIT_FAILURE;
+    return status;
+}
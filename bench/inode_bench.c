@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "inode.h"
+
+/*
+ * Compares whole-table sweeps over the inode records (one idisk_t per
+ * inode) against the same sweeps over the mode/size/address columns of
+ * inode_table_t.
+ *
+ *     dosiero_inode_bench [image]
+ *
+ * Without an image a scratch one with 64k inodes (s_isize 4096) is written
+ * to $TMPDIR and removed again.
+ */
+
+#define BENCH_ISIZE 4096
+#define BENCH_ROUNDS 50
+
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)(v & 0xFF);
+    p[1] = (unsigned char)(v >> 8);
+}
+
+/* Write an image whose inode area holds a plausible mix of free inodes,
+   directories, small and large files; data blocks are never read. */
+static int write_scratch_image(char *path) {
+    uint32_t data_start = 2 + BENCH_ISIZE, fsize = 65000;
+    size_t len = (size_t)(data_start + 1) * SECTOR_SIZE;
+    unsigned char *img = calloc(1, len);
+    if (!img) return -1;
+    put16(&img[SECTOR_SIZE + 0], BENCH_ISIZE);
+    put16(&img[SECTOR_SIZE + 2], (uint16_t)fsize);
+
+    srand(5);
+    for (uint32_t i = 0; i < (uint32_t)BENCH_ISIZE * INODES_PER_SECTOR; i++) {
+        unsigned char *p = img + 2 * SECTOR_SIZE + (size_t)i * INODE_SIZE;
+        int r = rand() % 100;
+        if (r < 20) continue;                       /* free */
+        uint16_t mode = 0100644;
+        if (r < 35) mode = 0140755;                 /* directory */
+        else if (r < 40) mode |= 010000;            /* large file */
+        put16(&p[0], mode);
+        p[2] = 1;
+        p[5] = (mode & 010000) ? (unsigned char)(rand() % 4) : 0;
+        put16(&p[6], (uint16_t)rand());
+        for (int k = 0; k < 8; k++)
+            if (rand() % 3) put16(&p[8 + k*2], (uint16_t)(data_start + rand() % (fsize - data_start)));
+    }
+
+    int fd = mkstemp(path);
+    if (fd < 0) { free(img); return -1; }
+    ssize_t n = write(fd, img, len);
+    close(fd);
+    free(img);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The sweeps, each over records (aos) and columns (soa) */
+static uint64_t dirs_aos(const inode_table_t *t) {
+    uint64_t n = 0;
+    for (uint32_t i = 1; i <= t->count; i++)
+        n += (t->slots[i].i_mode & 0160000) == 0140000;
+    return n;
+}
+
+static uint64_t dirs_soa(const inode_table_t *t) {
+    uint64_t n = 0;
+    for (uint32_t i = 1; i <= t->count; i++)
+        n += (t->modes[i] & 0160000) == 0140000;
+    return n;
+}
+
+static uint64_t bytes_aos(const inode_table_t *t) {
+    uint64_t n = 0;
+    for (uint32_t i = 1; i <= t->count; i++)
+        if ((t->slots[i].i_mode & 0160000) == 0100000) n += inode_size_bytes(&t->slots[i]);
+    return n;
+}
+
+static uint64_t bytes_soa(const inode_table_t *t) {
+    uint64_t n = 0;
+    for (uint32_t i = 1; i <= t->count; i++)
+        if ((t->modes[i] & 0160000) == 0100000) n += t->sizes[i];
+    return n;
+}
+
+static uint64_t addrs_aos(const inode_table_t *t) {
+    uint64_t n = 0;
+    for (uint32_t i = 1; i <= t->count; i++) {
+        if (!(t->slots[i].i_mode & 0100000)) continue;
+        for (int k = 0; k < 8; k++) n += t->slots[i].i_addr[k];
+    }
+    return n;
+}
+
+static uint64_t addrs_soa(const inode_table_t *t) {
+    uint64_t n = 0;
+    for (uint32_t i = 1; i <= t->count; i++) {
+        if (!(t->modes[i] & 0100000)) continue;
+        for (int k = 0; k < 8; k++) n += t->addrs[i][k];
+    }
+    return n;
+}
+
+typedef uint64_t (*sweep_fn)(const inode_table_t *);
+
+/* Best time of BENCH_ROUNDS runs, in ns per inode */
+static double time_sweep(sweep_fn fn, const inode_table_t *t, uint64_t *result) {
+    double best = 0;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        double t0 = now_ns();
+        *result = fn(t);
+        double dt = now_ns() - t0;
+        if (r == 0 || dt < best) best = dt;
+    }
+    return best / t->count;
+}
+
+int main(int argc, char **argv) {
+    char scratch[] = "/tmp/dosiero-bench-XXXXXX";
+    const char *path = argc > 1 ? argv[1] : scratch;
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [image]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc == 1 && write_scratch_image(scratch) != 0) {
+        fprintf(stderr, "Error: Unable to write scratch image\n");
+        return EXIT_FAILURE;
+    }
+
+    image_t *disk = image_open(path);
+    if (argc == 1) unlink(scratch);
+    unsigned char sbuf[SECTOR_SIZE];
+    const unsigned char *sb = disk ? read_sector(disk, 1, sbuf) : NULL;
+    if (!sb) {
+        fprintf(stderr, "Error: Unable to read superblock from '%s'\n", path);
+        if (disk) image_close(disk);
+        return EXIT_FAILURE;
+    }
+    uint32_t isize = (uint32_t)(sb[0] | (sb[1] << 8));
+    inode_table_t *t = inode_table_create(disk, 2, isize * INODES_PER_SECTOR);
+    if (!t) {
+        image_close(disk);
+        return EXIT_FAILURE;
+    }
+    inode_table_load_all(t);
+
+    static const struct { const char *name; sweep_fn aos, soa; } sweeps[] = {
+        { "count-dirs", dirs_aos, dirs_soa },
+        { "sum-sizes", bytes_aos, bytes_soa },
+        { "scan-addrs", addrs_aos, addrs_soa },
+    };
+    int status = EXIT_SUCCESS;
+    printf("%u inodes, record %zu bytes\n", (unsigned)t->count, sizeof(idisk_t));
+    printf("%-12s %12s %12s %8s\n", "sweep", "aos ns/ino", "soa ns/ino", "speedup");
+    for (size_t i = 0; i < sizeof(sweeps) / sizeof(sweeps[0]); i++) {
+        uint64_t ra, rs;
+        double a = time_sweep(sweeps[i].aos, t, &ra);
+        double s = time_sweep(sweeps[i].soa, t, &rs);
+        if (ra != rs) {
+            fprintf(stderr, "Error: %s: layouts disagree (%llu != %llu)\n", sweeps[i].name,
+                    (unsigned long long)ra, (unsigned long long)rs);
+            status = EXIT_FAILURE;
+        }
+        printf("%-12s %12.3f %12.3f %7.2fx\n", sweeps[i].name, a, s, s > 0 ? a / s : 0);
+    }
+
+    inode_table_free(t);
+    image_close(disk);
+    return status;
+}
@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "image.h"
+#include "inode.h"
+
+/*
+ * Writes a synthetic UNIX V5 disk image for benchmarking:
+ *
+ *     dosiero_mkimage [-n inodes] [-w fanout] [-d depth] [-L large%]
+ *                     [-g frag%] [-m maxsize] [-z sectors] [-r seed] <image>
+ *
+ *   -n  allocated inodes, root included (default 1024, at most 65520)
+ *   -w  entries per directory (default 16); a quarter of them, at least
+ *       one, are subdirectories while the depth allows
+ *   -d  deepest directory level below the root (default 4)
+ *   -L  percentage of regular files that are large (010000): 4 KiB to
+ *       256 KiB, through indirect blocks (default 2)
+ *   -g  fragmentation: percentage of block allocations that skip ahead
+ *       1..8 blocks or reuse one skipped earlier (default 0, every file
+ *       contiguous)
+ *   -m  largest size of a small file in bytes, at most 4096 (default 4096)
+ *   -z  filesystem size in sectors, at most 65535 (default 65535, 32 MiB);
+ *       block numbers are 16 bits wide, so no V5 image is larger
+ *   -r  seed (default 1); the same options and seed give the same image
+ *
+ * The tree is filled breadth first, so a small inode count gives a wide,
+ * shallow tree; if fanout and depth cannot hold -n inodes, fewer are made.
+ *
+ * Superblock, inode area, directories and the free-list chain are laid out
+ * the way dosiero reads them and pass -c cleanly.  File blocks hold a
+ * pattern derived from the i-number and offset.
+ */
+
+#define MKIMAGE_USAGE "Usage: %s [-n inodes] [-w fanout] [-d depth] [-L large%%] [-g frag%%] [-m maxsize] [-z sectors] [-r seed] <image>\n"
+
+#define MAX_INODES 65520      /* s_isize 4095; i-numbers are 16 bits */
+#define MAX_SECTORS 65535
+#define LARGE_MIN (8 * SECTOR_SIZE + 1)
+#define LARGE_MAX (256 * 1024)
+
+typedef struct {
+    unsigned char *img;
+    uint32_t fsize, data_start;
+    uint32_t next;             /* allocation cursor */
+    unsigned frag;
+    uint16_t *skipped;         /* blocks passed over by fragmentation */
+    uint32_t nskipped;
+    uint8_t *used;
+    uint32_t nused;
+} mkfs_t;
+
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)(v & 0xFF);
+    p[1] = (unsigned char)(v >> 8);
+}
+
+/* Small deterministic PRNG (xorshift32), independent of the C library */
+static uint32_t rng_state = 1;
+static uint32_t rng(void) {
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rng_state = x;
+}
+
+static uint32_t rng_range(uint32_t lo, uint32_t hi) {
+    return lo + rng() % (hi - lo + 1);
+}
+
+/* Next block to use, or 0 when the image is full.  A fragmenting
+   allocation either skips a few blocks, keeping them aside, or takes back
+   one kept aside earlier, so files jump both ways across the disk. */
+static uint16_t alloc_block(mkfs_t *fs) {
+    uint32_t b = 0;
+    if (fs->frag && rng() % 100 < fs->frag) {
+        if (fs->nskipped && rng() % 2) {
+            uint32_t i = rng() % fs->nskipped;
+            b = fs->skipped[i];
+            fs->skipped[i] = fs->skipped[--fs->nskipped];
+        } else {
+            for (uint32_t n = rng_range(1, 8); n > 0 && fs->next < fs->fsize; n--)
+                fs->skipped[fs->nskipped++] = (uint16_t)fs->next++;
+        }
+    }
+    if (!b && fs->next < fs->fsize) b = fs->next++;
+    if (!b && fs->nskipped) b = fs->skipped[--fs->nskipped];
+    if (!b) return 0;
+    fs->used[b] = 1;
+    fs->nused++;
+    return (uint16_t)b;
+}
+
+/* Store size bytes of data (or the file pattern when data is NULL) for
+   inode ino and fill in its size, mode and addresses.  Returns -1 if the
+   image is full. */
+static int write_file(mkfs_t *fs, uint32_t ino, uint16_t mode, const unsigned char *data, uint32_t size) {
+    unsigned char *p = fs->img + 2 * SECTOR_SIZE + (size_t)(ino - 1) * INODE_SIZE;
+    uint32_t nblocks = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    bool large = nblocks > 8;
+    if (nblocks > 8 * 256) return -1;
+    uint16_t addr[8] = { 0 };
+    unsigned char *indir = NULL;
+    for (uint32_t i = 0; i < nblocks; i++) {
+        if (large && i % 256 == 0) {
+            uint16_t ib = alloc_block(fs);
+            if (!ib) return -1;
+            addr[i / 256] = ib;
+            indir = fs->img + (size_t)ib * SECTOR_SIZE;
+        }
+        uint16_t b = alloc_block(fs);
+        if (!b) return -1;
+        if (large) put16(&indir[(i % 256) * 2], b);
+        else addr[i] = b;
+        unsigned char *blk = fs->img + (size_t)b * SECTOR_SIZE;
+        uint32_t off = i * SECTOR_SIZE;
+        uint32_t n = size - off < SECTOR_SIZE ? size - off : SECTOR_SIZE;
+        if (data) memcpy(blk, data + off, n);
+        else for (uint32_t k = 0; k < n; k++) blk[k] = (unsigned char)(ino * 31 + off + k);
+    }
+    if (large) mode |= 010000;
+    put16(&p[0], mode);
+    p[5] = (unsigned char)(size >> 16);
+    put16(&p[6], (uint16_t)size);
+    for (int k = 0; k < 8; k++) put16(&p[8 + k*2], addr[k]);
+    put16(&p[28], 0x0600);     /* fixed mtime, so images are reproducible */
+    return 0;
+}
+
+static void set_nlink(mkfs_t *fs, uint32_t ino, uint32_t nlink) {
+    fs->img[2 * SECTOR_SIZE + (size_t)(ino - 1) * INODE_SIZE + 2] = (unsigned char)(nlink > 255 ? 255 : nlink);
+}
+
+/* Thread every unused data block onto the free list the way the kernel's
+   free() would, from the top of the filesystem down. */
+static uint16_t build_free_list(mkfs_t *fs, uint16_t sfree[100]) {
+    uint16_t nfree = 0;
+    for (uint32_t b = fs->fsize; b-- > fs->data_start; ) {
+        if (fs->used[b]) continue;
+        if (nfree == 0) { nfree = 1; sfree[0] = 0; }
+        if (nfree >= 100) {
+            unsigned char *blk = fs->img + (size_t)b * SECTOR_SIZE;
+            put16(&blk[0], nfree);
+            for (int i = 0; i < 100; i++) put16(&blk[2 + i*2], sfree[i]);
+            nfree = 0;
+        }
+        sfree[nfree++] = (uint16_t)b;
+    }
+    return nfree;
+}
+
+static bool parse_num(const char *s, unsigned long lo, unsigned long hi, unsigned long *out) {
+    char *end;
+    if (!s || *s == '\0') return false;
+    unsigned long v = strtoul(s, &end, 10);
+    if (*end != '\0' || v < lo || v > hi) return false;
+    *out = v;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    unsigned long ninodes = 1024, fanout = 16, depth = 4, large = 2, frag = 0;
+    unsigned long maxsize = 8 * SECTOR_SIZE, sectors = MAX_SECTORS, seed = 1;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok;
+        if (a[0] != '-' && !path) {
+            path = a;
+            continue;
+        }
+        if (strcmp(a, "-n") == 0) ok = parse_num(v, 1, MAX_INODES, &ninodes);
+        else if (strcmp(a, "-w") == 0) ok = parse_num(v, 1, MAX_INODES, &fanout);
+        else if (strcmp(a, "-d") == 0) ok = parse_num(v, 0, 255, &depth);
+        else if (strcmp(a, "-L") == 0) ok = parse_num(v, 0, 100, &large);
+        else if (strcmp(a, "-g") == 0) ok = parse_num(v, 0, 100, &frag);
+        else if (strcmp(a, "-m") == 0) ok = parse_num(v, 0, 8 * SECTOR_SIZE, &maxsize);
+        else if (strcmp(a, "-z") == 0) ok = parse_num(v, 3, MAX_SECTORS, &sectors);
+        else if (strcmp(a, "-r") == 0) ok = parse_num(v, 1, UINT32_MAX, &seed);
+        else ok = false;
+        if (!ok) {
+            fprintf(stderr, MKIMAGE_USAGE, argv[0]);
+            return EXIT_FAILURE;
+        }
+        i++;
+    }
+    if (!path) {
+        fprintf(stderr, MKIMAGE_USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t isize = (uint32_t)(ninodes + INODES_PER_SECTOR - 1) / INODES_PER_SECTOR;
+    mkfs_t fs = { 0 };
+    fs.fsize = (uint32_t)sectors;
+    fs.data_start = 2 + isize;
+    fs.next = fs.data_start;
+    fs.frag = (unsigned)frag;
+    if (fs.data_start >= fs.fsize) {
+        fprintf(stderr, "Error: %lu sectors leave no room for data after %lu inodes\n", sectors, ninodes);
+        return EXIT_FAILURE;
+    }
+    rng_state = (uint32_t)seed;
+
+    fs.img = calloc(fs.fsize, SECTOR_SIZE);
+    fs.used = calloc(fs.fsize, 1);
+    fs.skipped = malloc(fs.fsize * sizeof(uint16_t));
+    uint32_t *queue = malloc((ninodes + 1) * sizeof(uint32_t));
+    uint8_t *level = calloc(ninodes + 1, 1);
+    uint16_t *parent = calloc(ninodes + 1, sizeof(uint16_t));
+    unsigned char *dirbuf = malloc((fanout + 2) * 16);
+    if (!fs.img || !fs.used || !fs.skipped || !queue || !level || !parent || !dirbuf) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Breadth first: each directory taken off the queue gets its entries,
+       subdirectories first, then its own data block(s). */
+    uint32_t next_ino = 2, head = 0, tail = 0, ndirs = 1, nfiles = 0, nlarge = 0;
+    uint32_t subdirs = fanout / 4 ? (uint32_t)(fanout / 4) : 1;
+    bool full = false;
+    queue[tail++] = 1;
+    parent[1] = 1;
+    while (head < tail && !full) {
+        uint32_t dir = queue[head++];
+        uint32_t nent = 0, nsub = 0;
+        put16(&dirbuf[0], (uint16_t)dir);
+        memcpy(&dirbuf[2], ".\0\0\0\0\0\0\0\0\0\0\0\0\0", 14);
+        put16(&dirbuf[16], parent[dir]);
+        memcpy(&dirbuf[18], "..\0\0\0\0\0\0\0\0\0\0\0\0", 14);
+        for (uint32_t c = 0; c < fanout && next_ino <= ninodes && !full; c++) {
+            uint32_t ino = next_ino++;
+            bool isdir = c < subdirs && level[dir] < depth;
+            unsigned char *ent = &dirbuf[(2 + nent++) * 16];
+            memset(ent, 0, 16);
+            put16(ent, (uint16_t)ino);
+            snprintf((char *)ent + 2, 14, "%c%u", isdir ? 'd' : 'f', (unsigned)ino);
+            if (isdir) {
+                parent[ino] = (uint16_t)dir;
+                level[ino] = level[dir] + 1;
+                queue[tail++] = ino;
+                ndirs++;
+                nsub++;
+                continue;
+            }
+            bool big = rng() % 100 < large;
+            uint32_t size = big ? rng_range(LARGE_MIN, LARGE_MAX) : rng_range(0, (uint32_t)maxsize);
+            if (write_file(&fs, ino, 0100644, NULL, size) != 0) full = true;
+            set_nlink(&fs, ino, 1);
+            nfiles++;
+            nlarge += big;
+        }
+        if (!full && write_file(&fs, dir, 0140755, dirbuf, (2 + nent) * 16) != 0) full = true;
+        set_nlink(&fs, dir, 2 + nsub);
+    }
+    if (full) {
+        fprintf(stderr, "Error: Image full after %u inodes; use more sectors (-z), smaller files (-m, -L) or fewer inodes (-n)\n",
+                (unsigned)(next_ino - 1));
+        return EXIT_FAILURE;
+    }
+
+    if (next_ino <= ninodes)
+        fprintf(stderr, "Warning: fanout %lu and depth %lu hold only %u of the %lu inodes\n",
+                fanout, depth, (unsigned)(next_ino - 1), ninodes);
+
+    uint16_t sfree[100] = { 0 };
+    uint16_t nfree = build_free_list(&fs, sfree);
+    unsigned char *sb = fs.img + SECTOR_SIZE;
+    put16(&sb[0], (uint16_t)isize);
+    put16(&sb[2], (uint16_t)fs.fsize);
+    put16(&sb[4], nfree);
+    for (int i = 0; i < 100; i++) put16(&sb[6 + i*2], sfree[i]);
+
+    FILE *out = fopen(path, "wb");
+    if (!out || fwrite(fs.img, SECTOR_SIZE, fs.fsize, out) != fs.fsize || fclose(out) != 0) {
+        fprintf(stderr, "Error: Unable to write '%s'\n", path);
+        return EXIT_FAILURE;
+    }
+    printf("%s: %u inodes (%u directories, %u files, %u large), %u of %u data blocks used\n",
+           path, (unsigned)(next_ino - 1), (unsigned)ndirs, (unsigned)nfiles, (unsigned)nlarge,
+           (unsigned)fs.nused, (unsigned)(fs.fsize - fs.data_start));
+
+    free(fs.img);
+    free(fs.used);
+    free(fs.skipped);
+    free(queue);
+    free(level);
+    free(parent);
+    free(dirbuf);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+#ifndef BLOCKMAP_H
+#define BLOCKMAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "image.h"
+
+/* Block map of an inode, decoded once from i_addr[8] (and the indirect
+   blocks of a large file) into runs of logical blocks.  Every logical
+   block slot of the address table is covered, in file order:
+     BLOCKMAP_DATA  count physically consecutive sectors from start
+     BLOCKMAP_HOLE  count zero addresses (a zero indirect block is 256)
+     BLOCKMAP_BAD   count addresses outside the data area or the image,
+                    or the 256 slots of such or unreadable indirect block
+   Trailing holes are dropped. */
+
+enum { BLOCKMAP_DATA, BLOCKMAP_HOLE, BLOCKMAP_BAD };
+
+typedef struct {
+    uint16_t start;            /* first sector (DATA), offending address (BAD) */
+    uint16_t count;            /* logical blocks covered */
+    uint8_t kind;
+} extent_t;
+
+typedef struct {
+    extent_t *ext;
+    uint32_t n;
+} blockmap_t;
+
+/* Decode the address table of an inode with the given mode.  Returns 0 on
+   success, -1 if out of memory. */
+int blockmap_compile(image_t *disk, uint16_t mode, const uint16_t addr[8],
+                     uint32_t data_start, uint32_t data_end, blockmap_t *bm);
+
+void blockmap_free(blockmap_t *bm);
+
+/* Cursor over the data sectors of a map, skipping holes and bad slots:
+       blockmap_iter_t it = BLOCKMAP_ITER(bm);
+       while (blockmap_next(&it, &sec)) ... */
+typedef struct {
+    const blockmap_t *bm;
+    uint32_t i;                /* current extent */
+    uint32_t j;                /* next block within it */
+} blockmap_iter_t;
+
+#define BLOCKMAP_ITER(bm) ((blockmap_iter_t){ (bm), 0, 0 })
+
+static inline bool blockmap_next(blockmap_iter_t *it, uint32_t *sec) {
+    const blockmap_t *bm = it->bm;
+    while (bm && it->i < bm->n) {
+        const extent_t *x = &bm->ext[it->i];
+        if (x->kind == BLOCKMAP_DATA && it->j < x->count) {
+            *sec = (uint32_t)x->start + it->j++;
+            return true;
+        }
+        it->i++;
+        it->j = 0;
+    }
+    return false;
+}
+
+/* Random access to an address table without compiling a map.  The
+   sector of a logical block is found from its i_addr slot, or for a large
+   file from slot lbn / 256 and entry lbn % 256 of that indirect block,
+   which is kept until a lookup needs another:
+       blockmap_cursor_t c;
+       blockmap_cursor_init(&c, disk, mode, addr, data_start, data_end);
+       switch (blockmap_lookup(&c, lbn, &sec)) ... */
+typedef struct {
+    image_t *disk;
+    uint16_t mode;
+    const uint16_t *addr;
+    uint32_t data_start, data_end;
+    int indir;                 /* slot whose indirect block is held, -1 for none */
+    const unsigned char *iblk; /* NULL if that block is bad */
+    unsigned char buf[SECTOR_SIZE];
+} blockmap_cursor_t;
+
+void blockmap_cursor_init(blockmap_cursor_t *c, image_t *disk, uint16_t mode, const uint16_t addr[8],
+                          uint32_t data_start, uint32_t data_end);
+
+/* Kind of logical block lbn as blockmap_compile() classifies it, with the
+   sector (DATA) or offending address (BAD) in *sec; blocks past the end
+   of the address table are holes. */
+int blockmap_lookup(blockmap_cursor_t *c, uint32_t lbn, uint16_t *sec);
+
+#endif /* BLOCKMAP_H */
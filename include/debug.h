@@ -33,6 +33,7 @@
 #define WARN
 #define ERROR
 #define SUCCESS
+#define STATS
 #endif
 
 #ifdef DEBUG
@@ -85,4 +86,50 @@
 #define error(S, ...)
 #endif
 
+/* I/O and timing counters behind --stats (stats.c).  Sector reads are
+   charged to the kind last named with stat_kind() on the calling thread,
+   time to the phase the main thread is in.  Without STATS every hook
+   compiles to nothing. */
+#ifdef STATS
+#include <stdint.h>
+
+enum { STAT_SUPER, STAT_INODE, STAT_DIR, STAT_INDIRECT, STAT_DATA, STAT_FREELIST, STAT_KINDS };
+enum { STAT_PH_SUPER, STAT_PH_INODES, STAT_PH_QUERY, STAT_PH_OUTPUT, STAT_PHASES };
+
+typedef struct {
+  uint64_t sectors[STAT_KINDS];
+  uint64_t bytes;
+  uint64_t preads;
+  uint64_t cache_hits, cache_misses;
+  uint64_t entries;
+  uint64_t wall_ns[STAT_PHASES], cpu_ns[STAT_PHASES];
+} stats_t;
+
+extern stats_t stats;
+extern __thread int stats_kind;
+
+/* Start timing on the calling (main) thread, in the superblock phase. */
+void stats_start(void);
+/* Move the main thread to phase; returns the phase it was in.  Other
+   threads are not timed. */
+int stats_phase(int phase);
+void stats_report(FILE *out);
+
+#define stat_add(F, N) __atomic_fetch_add(&stats.F, (uint64_t)(N), __ATOMIC_RELAXED)
+#define stat_kind(K) (stats_kind = (K))
+#define stat_sectors(N)                                                        \
+  do {                                                                         \
+    stat_add(sectors[stats_kind], (N));                                        \
+    stat_add(bytes, (uint64_t)(N) * 512);                                      \
+  } while (0)
+#define stat_phase_enter(P) int stat_prev_phase_ = stats_phase(P)
+#define stat_phase_leave() stats_phase(stat_prev_phase_)
+#else
+#define stat_add(F, N) ((void)0)
+#define stat_kind(K) ((void)0)
+#define stat_sectors(N) ((void)0)
+#define stat_phase_enter(P) ((void)0)
+#define stat_phase_leave() ((void)0)
+#endif
+
 #endif /* DEBUG_H */
@@ -0,0 +1,27 @@
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include <stdint.h>
+
+/* Directory-sector name matching.  A 512-byte directory sector holds 32
+   entries of 16 bytes (2-byte i-number, 14-byte name); dirent_match()
+   compares a prepared key against all of them at once using SSE2 or AVX2
+   when the CPU has it, otherwise a scalar loop, picked at startup. */
+
+typedef struct {
+    unsigned char bytes[16];   /* entry image: i-number bytes unused, name padded */
+    uint16_t care;             /* bit i set: entry byte i must equal bytes[i] */
+} dirent_key_t;
+
+/* Prepare a key that matches entries the way strncmp(entry_name, name, 14)
+   == 0 would: bytes after the terminating NUL are ignored. */
+void dirent_key_init(dirent_key_t *key, const char *name);
+
+/* Return a mask with bit e set for every in-use entry (non-zero i-number)
+   of the sector blk whose name matches key. */
+uint32_t dirent_match(const unsigned char *blk, const dirent_key_t *key);
+
+/* Name of the kernel in use ("avx2", "sse2" or "scalar"). */
+const char *dirent_match_impl(void);
+
+#endif /* DIRSCAN_H */
@@ -1,2 +1,79 @@
+#ifndef DOSIERO_H
+#define DOSIERO_H
 
-extern int dosiero_main(int argc, char **argv);
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Symbols exported from libdosiero.so; everything else stays hidden */
+#define DOSIERO_API __attribute__((visibility("default")))
+
+DOSIERO_API extern int dosiero_main(int argc, char **argv);
+
+/*
+ * Daemon (-s) wire format, over a Unix domain stream socket.
+ * Request:  4-byte big-endian length, then a batch-mode query line
+ *           ("r PATH", "p INUM", "P INUM", "l PATH", "x PATH" or "xi INUM").
+ * Response: 4-byte big-endian exit status, 4-byte big-endian length, then
+ *           exactly the bytes the equivalent command prints on stdout.
+ * A connection may carry any number of requests.
+ */
+#define DOSIERO_MAX_REQUEST 8192
+
+/*
+ * Library interface (libdosiero.a, libdosiero.so).
+ *
+ * A handle holds one open image together with its inode table, block maps
+ * and lookup indexes, which are filled in as queries need them and kept
+ * until dosiero_close(), so repeated calls cost what the long-running -b
+ * and -s modes cost per query.  Any number of threads may call into one
+ * handle at once (each with its own dosiero_dir_t); only dosiero_close()
+ * must wait until the others are done.  On error the functions set errno
+ * and return NULL, 0 or -1:
+ *     ENOENT   no such path, or the inode is not allocated
+ *     ENOTDIR  a directory was required
+ *     EINVAL   i-number out of range, relative path or device inode
+ *     EIO      unreadable image or block outside the data area
+ *     ENOMEM   out of memory
+ */
+typedef struct dosiero dosiero_t;
+typedef struct dosiero_dir dosiero_dir_t;
+
+typedef struct {
+    uint32_t ino;
+    uint16_t mode;             /* i_mode as stored, including 0100000 */
+    uint8_t nlink, uid, gid;
+    uint32_t size;             /* bytes */
+    uint32_t mtime;
+} dosiero_stat_t;
+
+typedef struct {
+    uint32_t ino;
+    char name[15];             /* NUL-terminated */
+} dosiero_dirent_t;
+
+DOSIERO_API dosiero_t *dosiero_open(const char *image);
+DOSIERO_API void dosiero_close(dosiero_t *d);
+
+/* I-number of an absolute pathname, or 0 */
+DOSIERO_API uint32_t dosiero_resolve(dosiero_t *d, const char *path);
+
+/* Canonical pathname of directory ino, as -p prints it; free() it */
+DOSIERO_API char *dosiero_path(dosiero_t *d, uint32_t ino);
+
+DOSIERO_API int dosiero_stat(dosiero_t *d, uint32_t ino, dosiero_stat_t *st);
+
+/* Entries of directory ino in on-disk order, "." and ".." included.
+   dosiero_readdir() returns NULL at the end; the entry is overwritten by
+   the next call. */
+DOSIERO_API dosiero_dir_t *dosiero_opendir(dosiero_t *d, uint32_t ino);
+DOSIERO_API const dosiero_dirent_t *dosiero_readdir(dosiero_dir_t *dir);
+DOSIERO_API void dosiero_closedir(dosiero_dir_t *dir);
+
+/* Copy up to len bytes of inode ino starting at byte off into buf.  Holes
+   read as zeros, as with -x --offset; plain -x leaves them out.  Returns
+   the number of bytes copied, short only before a bad block, 0 at or past
+   the end of the file, or -1. */
+DOSIERO_API ssize_t dosiero_read(dosiero_t *d, uint32_t ino, void *buf, size_t len, uint64_t off);
+
+#endif /* DOSIERO_H */
@@ -0,0 +1,68 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define SECTOR_SIZE 512
+
+/* Capacity (in sectors) of the LRU cache used by the pread fallback. */
+#ifndef SECTOR_CACHE_SLOTS
+#define SECTOR_CACHE_SLOTS 256
+#endif
+
+typedef struct {
+    uint32_t sector;
+    int32_t prev, next;        /* LRU list, -1 terminated */
+    int32_t hnext;             /* hash chain, -1 terminated */
+    unsigned char data[SECTOR_SIZE];
+} cache_slot_t;
+
+/* Bounded LRU cache of sectors read with pread(); lock guards all of it. */
+typedef struct {
+    pthread_mutex_t lock;
+    cache_slot_t *slots;
+    int32_t *buckets;
+    uint32_t nbuckets;
+    uint32_t used;
+    int32_t head, tail;        /* most / least recently used */
+    unsigned long hits, misses;
+} sector_cache_t;
+
+/* Disk image backend.  Regular files are mmap'd and sectors are handed out
+   as pointers into the mapping; anything that cannot be mapped falls back
+   to pread() through a sector cache (non-seekable inputs such as pipes are
+   read into memory up front).  Nothing moves a shared file position, so
+   any number of threads may read one image at once. */
+typedef struct {
+    const unsigned char *base; /* mapped or in-memory image, or NULL */
+    size_t size;               /* bytes available at base */
+    bool mapped;               /* base came from mmap (otherwise malloc) */
+    sector_cache_t cache;      /* only used by the pread fallback */
+    int fd;                    /* image file for offset I/O, -1 if none */
+    uint32_t nsectors;         /* whole sectors in the image */
+} image_t;
+
+/* Open a disk image; returns NULL on error. */
+image_t *image_open(const char *path);
+
+/* True if sector lies entirely within the image, i.e. read_sector() on it
+   can only fail for I/O errors. */
+static inline bool image_has_sector(const image_t *img, uint32_t sector) {
+    return sector < img->nsectors;
+}
+
+/* Release the mapping/stream and the handle itself. */
+void image_close(image_t *img);
+
+/* Return a pointer to the 512 bytes of a sector, or NULL on error.
+   For in-memory images the pointer refers directly into the image and buf
+   is untouched; otherwise the sector is copied into buf (from the sector
+   cache, or from the file on a miss) and buf is returned.  Safe to call
+   from several threads, each with its own buf. */
+const unsigned char *read_sector(image_t *img, uint32_t sector, unsigned char *buf);
+
+#endif /* IMAGE_H */
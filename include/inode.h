@@ -0,0 +1,94 @@
+#ifndef INODE_H
+#define INODE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "image.h"
+#include "blockmap.h"
+
+#define INODE_SIZE 32
+#define INODES_PER_SECTOR (SECTOR_SIZE / INODE_SIZE)
+
+/* inode on-disk representation (subset used) */
+typedef struct {
+    uint16_t i_mode;
+    uint8_t  i_nlink;
+    uint8_t  i_uid;
+    uint8_t  i_gid;
+    uint8_t  i_size0;
+    uint16_t i_size1;
+    uint16_t i_addr[8];
+    uint32_t i_mtime;
+    blockmap_t *i_map;         /* decoded i_addr, NULL until first needed */
+} idisk_t;
+
+/* Helper to build a 24-bit size from i_size0/i_size1 */
+static inline uint32_t inode_size_bytes(const idisk_t *ino) {
+    return ((uint32_t)ino->i_size0 << 16) | (uint32_t)(ino->i_size1 & 0xFFFF);
+}
+
+/* In-memory inode table.  Inodes are decoded from the inode area a sector
+   (16 inodes) at a time, on first access, so opening an image costs the
+   same whatever its s_isize; inode_table_load_all() decodes the rest up
+   front for passes that touch every inode.  Lookups may come from several
+   threads: a sector is decoded under lock and its ready flag published
+   after its entries, so a reader that sees the flag sees the inodes.
+
+   Next to the full records, the fields that whole-table sweeps look at are
+   also kept as columns: a pass over i_mode, the size or the block
+   addresses walks 2, 4 or 16 bytes per inode instead of a whole idisk_t.
+   Every array is indexed by i-number; entry 0 stays zero (unallocated). */
+typedef struct {
+    image_t *disk;
+    uint32_t start_sector;     /* first sector of the inode area */
+    uint32_t count;            /* inodes 1..count */
+    idisk_t *slots;            /* full records */
+    uint16_t *modes;           /* i_mode */
+    uint32_t *sizes;           /* size in bytes */
+    uint16_t (*addrs)[8];      /* i_addr */
+    uint8_t *ready;            /* per inode-area sector: entries decoded */
+    pthread_mutex_t lock;      /* serializes decoding */
+} inode_table_t;
+
+/* Table for the count inodes whose area starts at start_sector; nothing
+   is read yet.  Returns NULL if out of memory. */
+inode_table_t *inode_table_create(image_t *disk, uint32_t start_sector, uint32_t count);
+
+/* Free the table, including any block maps hung off its records. */
+void inode_table_free(inode_table_t *t);
+
+/* Decode inode-area sector s (relative to start_sector) unless another
+   thread got there first.  An unreadable sector leaves its inodes
+   unallocated. */
+void inode_table_decode(inode_table_t *t, uint32_t s);
+
+void inode_table_load_all(inode_table_t *t);
+
+/* Index of inode ino in the arrays, decoding its sector if this is the
+   first access; 0 for out of range i-numbers. */
+static inline uint32_t inode_slot(inode_table_t *t, uint32_t ino) {
+    if (ino == 0 || ino > t->count) return 0;
+    uint32_t s = (ino - 1) / INODES_PER_SECTOR;
+    if (!__atomic_load_n(&t->ready[s], __ATOMIC_ACQUIRE)) inode_table_decode(t, s);
+    return ino;
+}
+
+static inline idisk_t *inode_at(inode_table_t *t, uint32_t ino) {
+    return &t->slots[inode_slot(t, ino)];
+}
+
+static inline uint16_t inode_mode(inode_table_t *t, uint32_t ino) {
+    return t->modes[inode_slot(t, ino)];
+}
+
+static inline uint32_t inode_size(inode_table_t *t, uint32_t ino) {
+    return t->sizes[inode_slot(t, ino)];
+}
+
+static inline const uint16_t *inode_addrs(inode_table_t *t, uint32_t ino) {
+    return t->addrs[inode_slot(t, ino)];
+}
+
+#endif /* INODE_H */
@@ -0,0 +1,123 @@
+#include <stdlib.h>
+
+#include "blockmap.h"
+#include "debug.h"
+
+typedef struct {
+    blockmap_t *bm;
+    uint32_t cap;
+    uint32_t data_start, data_end;
+    image_t *disk;
+} builder_t;
+
+static int push(builder_t *b, uint8_t kind, uint16_t start, uint32_t count) {
+    blockmap_t *bm = b->bm;
+    if (bm->n > 0) {
+        extent_t *last = &bm->ext[bm->n - 1];
+        if (last->kind == kind && (uint32_t)last->count + count <= UINT16_MAX &&
+            (kind != BLOCKMAP_DATA || (uint32_t)last->start + last->count == start)) {
+            last->count += (uint16_t)count;
+            return 0;
+        }
+    }
+    if (bm->n == b->cap) {
+        uint32_t ncap = b->cap ? b->cap * 2 : 8;
+        extent_t *ext = realloc(bm->ext, ncap * sizeof(extent_t));
+        if (!ext) return -1;
+        bm->ext = ext;
+        b->cap = ncap;
+    }
+    bm->ext[bm->n++] = (extent_t){ start, (uint16_t)count, kind };
+    return 0;
+}
+
+static bool in_data_area(image_t *disk, uint32_t data_start, uint32_t data_end, uint16_t sec) {
+    return sec >= data_start && sec <= data_end && image_has_sector(disk, sec);
+}
+
+static bool valid(const builder_t *b, uint16_t sec) {
+    return in_data_area(b->disk, b->data_start, b->data_end, sec);
+}
+
+static int push_addr(builder_t *b, uint16_t sec) {
+    if (sec == 0) return push(b, BLOCKMAP_HOLE, 0, 1);
+    if (!valid(b, sec)) return push(b, BLOCKMAP_BAD, sec, 1);
+    return push(b, BLOCKMAP_DATA, sec, 1);
+}
+
+int blockmap_compile(image_t *disk, uint16_t mode, const uint16_t addr[8],
+                     uint32_t data_start, uint32_t data_end, blockmap_t *bm) {
+    bm->ext = NULL;
+    bm->n = 0;
+    builder_t b = { bm, 0, data_start, data_end, disk };
+
+    if (!(mode & 010000)) {
+        for (int k = 0; k < 8; k++)
+            if (push_addr(&b, addr[k]) != 0) goto fail;
+    } else {
+        unsigned char indirbuf[SECTOR_SIZE];
+        for (int k = 0; k < 8; k++) {
+            uint16_t indir = addr[k];
+            const unsigned char *iblk = NULL;
+            if (indir == 0) {
+                if (push(&b, BLOCKMAP_HOLE, 0, 256) != 0) goto fail;
+                continue;
+            }
+            stat_kind(STAT_INDIRECT);
+            if (valid(&b, indir)) iblk = read_sector(disk, indir, indirbuf);
+            if (!iblk) {
+                if (push(&b, BLOCKMAP_BAD, indir, 256) != 0) goto fail;
+                continue;
+            }
+            for (int e = 0; e < 256; e++)
+                if (push_addr(&b, (uint16_t)(iblk[e*2] | (iblk[e*2 + 1] << 8))) != 0) goto fail;
+        }
+    }
+    while (bm->n > 0 && bm->ext[bm->n - 1].kind == BLOCKMAP_HOLE) bm->n--;
+    return 0;
+
+fail:
+    blockmap_free(bm);
+    return -1;
+}
+
+void blockmap_free(blockmap_t *bm) {
+    free(bm->ext);
+    bm->ext = NULL;
+    bm->n = 0;
+}
+
+void blockmap_cursor_init(blockmap_cursor_t *c, image_t *disk, uint16_t mode, const uint16_t addr[8],
+                          uint32_t data_start, uint32_t data_end) {
+    c->disk = disk;
+    c->mode = mode;
+    c->addr = addr;
+    c->data_start = data_start;
+    c->data_end = data_end;
+    c->indir = -1;
+    c->iblk = NULL;
+}
+
+int blockmap_lookup(blockmap_cursor_t *c, uint32_t lbn, uint16_t *sec) {
+    uint16_t a;
+    if (!(c->mode & 010000)) {
+        if (lbn >= 8) return BLOCKMAP_HOLE;
+        a = c->addr[lbn];
+    } else {
+        uint32_t k = lbn / 256;
+        if (k >= 8 || c->addr[k] == 0) return BLOCKMAP_HOLE;
+        if (c->indir != (int)k) {
+            c->indir = (int)k;
+            c->iblk = NULL;
+            stat_kind(STAT_INDIRECT);
+            if (in_data_area(c->disk, c->data_start, c->data_end, c->addr[k]))
+                c->iblk = read_sector(c->disk, c->addr[k], c->buf);
+        }
+        if (!c->iblk) { *sec = c->addr[k]; return BLOCKMAP_BAD; }
+        const unsigned char *p = c->iblk + (lbn % 256) * 2;
+        a = (uint16_t)(p[0] | (p[1] << 8));
+    }
+    if (a == 0) return BLOCKMAP_HOLE;
+    *sec = a;
+    return in_data_area(c->disk, c->data_start, c->data_end, a) ? BLOCKMAP_DATA : BLOCKMAP_BAD;
+}
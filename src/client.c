@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dosiero.h"
+
+/*
+ * Client for a dosiero daemon started with "dosiero -f <image> -s <socket>".
+ * Takes the same query options as dosiero itself and prints exactly what
+ * dosiero would, exiting with the same status.
+ */
+
+#define CLIENT_USAGE "Usage: %s <socket> (-r <path> | -p <inum> | -P <inum> | -l <path> -n | -x <arg> (-i | -n))\n"
+
+static int read_full(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, CLIENT_USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *sockpath = argv[1];
+
+    char mode = 0;
+    bool i_seen = false, n_seen = false;
+    const char *arg = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0) i_seen = true;
+        else if (strcmp(argv[i], "-n") == 0) n_seen = true;
+        else if (argv[i][0] == '-' && argv[i][1] != '\0' && strchr("rpPlx", argv[i][1]) &&
+                 argv[i][2] == '\0' && !mode) mode = argv[i][1];
+        else if (argv[i][0] != '-' && !arg) arg = argv[i];
+        else { fprintf(stderr, CLIENT_USAGE, argv[0]); return EXIT_FAILURE; }
+    }
+    bool ok = mode && arg;
+    if (mode == 'l' || mode == 'x') ok = ok && (i_seen ^ n_seen);
+    else ok = ok && !i_seen && !n_seen;
+    if (mode == 'l' && i_seen) ok = false;
+    if (!ok) {
+        fprintf(stderr, CLIENT_USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char line[DOSIERO_MAX_REQUEST];
+    char op[3] = { mode, (mode == 'x' && i_seen) ? 'i' : '\0', '\0' };
+    int len = snprintf(line, sizeof(line), "%s %s", op, arg);
+    if (len < 0 || (size_t)len >= sizeof(line)) {
+        fprintf(stderr, "Error: Query too long\n");
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: '%s'\n", sockpath);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, sockpath);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: Unable to connect to '%s': %s\n", sockpath, strerror(errno));
+        if (fd >= 0) close(fd);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t hdr[2] = { htonl((uint32_t)len), 0 };
+    if (write_full(fd, hdr, 4) != 0 || write_full(fd, line, (size_t)len) != 0 ||
+        read_full(fd, hdr, sizeof(hdr)) != 0) {
+        fprintf(stderr, "Error: Lost connection to '%s'\n", sockpath);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    int status = (int)ntohl(hdr[0]);
+    size_t remaining = ntohl(hdr[1]);
+    char buf[8192];
+    while (remaining > 0) {
+        size_t chunk = remaining < sizeof(buf) ? remaining : sizeof(buf);
+        if (read_full(fd, buf, chunk) != 0) {
+            fprintf(stderr, "Error: Lost connection to '%s'\n", sockpath);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        fwrite(buf, 1, chunk, stdout);
+        remaining -= chunk;
+    }
+    close(fd);
+    return status;
+}
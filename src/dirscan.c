@@ -0,0 +1,82 @@
+#include <string.h>
+
+#include "dirscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIRSCAN_X86 1
+#endif
+
+void dirent_key_init(dirent_key_t *key, const char *name) {
+    size_t n = strnlen(name, 14);
+    memset(key->bytes, 0, sizeof(key->bytes));
+    memcpy(&key->bytes[2], name, n);
+    /* compare the name and, when shorter than 14, its terminating NUL */
+    uint32_t width = n < 14 ? n + 1 : 14;
+    key->care = (uint16_t)(((1u << width) - 1) << 2);
+}
+
+static uint32_t match_scalar(const unsigned char *blk, const dirent_key_t *key) {
+    uint32_t mask = 0;
+    for (int e = 0; e < 32; e++) {
+        const unsigned char *ent = &blk[e*16];
+        if (ent[0] == 0 && ent[1] == 0) continue;
+        int i = 2;
+        while (i < 16 && (!((key->care >> i) & 1) || ent[i] == key->bytes[i])) i++;
+        if (i == 16) mask |= 1u << e;
+    }
+    return mask;
+}
+
+#ifdef DIRSCAN_X86
+__attribute__((target("sse2")))
+static uint32_t match_sse2(const unsigned char *blk, const dirent_key_t *key) {
+    const __m128i k = _mm_loadu_si128((const __m128i *)key->bytes);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t mask = 0;
+    for (int e = 0; e < 32; e++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&blk[e*16]);
+        uint32_t eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, k));
+        uint32_t z = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        if ((eq & key->care) == key->care && (z & 3) != 3) mask |= 1u << e;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static uint32_t match_avx2(const unsigned char *blk, const dirent_key_t *key) {
+    const __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)key->bytes));
+    const __m256i zero = _mm256_setzero_si256();
+    const uint32_t care = (uint32_t)key->care | ((uint32_t)key->care << 16);
+    uint32_t mask = 0;
+    for (int e = 0; e < 32; e += 2) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&blk[e*16]);
+        uint32_t eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, k));
+        uint32_t z = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        uint32_t hit = ~eq & care;
+        if (!(hit & 0xFFFF) && (z & 3) != 3) mask |= 1u << e;
+        if (!(hit >> 16) && ((z >> 16) & 3) != 3) mask |= 2u << e;
+    }
+    return mask;
+}
+#endif
+
+static uint32_t (*match_impl)(const unsigned char *, const dirent_key_t *) = match_scalar;
+static const char *match_name = "scalar";
+
+__attribute__((constructor))
+static void dirscan_select(void) {
+#ifdef DIRSCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) { match_impl = match_avx2; match_name = "avx2"; }
+    else if (__builtin_cpu_supports("sse2")) { match_impl = match_sse2; match_name = "sse2"; }
+#endif
+}
+
+uint32_t dirent_match(const unsigned char *blk, const dirent_key_t *key) {
+    return match_impl(blk, key);
+}
+
+const char *dirent_match_impl(void) {
+    return match_name;
+}
@@ -1,444 +1,2486 @@
+#define _GNU_SOURCE /* copy_file_range */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
 
 #include "dosiero.h"
+#include "image.h"
+#include "dirscan.h"
+#include "blockmap.h"
+#include "inode.h"
 #include "debug.h"
 
+/* Upper bound on worker threads for -c and -a; -c gives each thread at
+   least CHECK_MIN_CHUNK inodes */
+#ifndef MAX_WORKER_THREADS
+#define MAX_WORKER_THREADS 16
+#endif
+#define CHECK_MIN_CHUNK 1024
+
+/* Extents shorter than this are copied out of the image with fwrite; longer
+   ones are handed to the kernel when both ends are real files */
+#define EXTRACT_ZEROCOPY_MIN (64 * 1024)
+
+/* Bytes -x --offset/--length copies per inode_pread() */
+#define EXTRACT_RANGE_CHUNK (64 * 1024)
+
+/* A daemon client stuck this long halfway through a request or an answer
+   is dropped */
+#define SERVE_TIMEOUT_MS 5000
+
 /* Helper to parse little-endian 16-bit values */
 static uint16_t le16(const unsigned char *p) {
 	return (uint16_t)(p[0] | (p[1] << 8));
 }
 
-/* Read a sector into buffer; return 0 on success, -1 on error */
-static int read_sector(FILE *disk, uint32_t sector, unsigned char *buf) {
-	if (fseek(disk, (long)sector * 512L, SEEK_SET) != 0) return -1;
-	if (fread(buf, 1, 512, disk) != 512) return -1;
-	return 0;
+/* Number of worker threads for -c and -a: one per online CPU. */
+static int worker_threads(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) return 1;
+    return ncpu > MAX_WORKER_THREADS ? MAX_WORKER_THREADS : (int)ncpu;
+}
+
+/* Block map of an inode, decoded on first use and kept with the inode so
+   the indirect blocks are read once however often the inode is walked.
+   Safe to call from several threads; the first map published wins.
+   Returns NULL if out of memory. */
+static const blockmap_t *inode_blockmap(image_t *disk, idisk_t *in,
+                                        uint32_t data_start, uint32_t data_end) {
+    blockmap_t *bm = __atomic_load_n(&in->i_map, __ATOMIC_ACQUIRE);
+    if (bm) return bm;
+    bm = malloc(sizeof(blockmap_t));
+    if (!bm) return NULL;
+    if (blockmap_compile(disk, in->i_mode, in->i_addr, data_start, data_end, bm) != 0) {
+        free(bm);
+        return NULL;
+    }
+    blockmap_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&in->i_map, &expected, bm, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        blockmap_free(bm);
+        free(bm);
+        return expected;
+    }
+    return bm;
+}
+
+/* Keys for "." and "..", as dirent_key_init() would build them */
+static const dirent_key_t dot_key = { { 0, 0, '.' }, 0x000C };
+static const dirent_key_t dotdot_key = { { 0, 0, '.', '.' }, 0x001C };
+
+/* helper to check a data sector for name */
+static uint16_t check_sector(image_t *disk, uint16_t sec, unsigned char *secbuf, inode_table_t *inodes, uint32_t inode_count, const dirent_key_t *key, uint32_t data_start, uint32_t data_end) {
+    if (sec == 0) return 0;
+    if (sec < data_start || sec > data_end) return 0;
+    stat_kind(STAT_DIR);
+    const unsigned char *blk = read_sector(disk, sec, secbuf);
+    if (!blk) return 0;
+    stat_add(entries, 32);
+    uint32_t m = dirent_match(blk, key);
+    if (m) return le16(&blk[__builtin_ctz(m) * 16]);
+    return 0;
+}
+
+/* Directory index: per-directory hash table of 14-byte name -> i-number,
+   built lazily the first time a directory is searched.  A table is filled
+   privately and then published, so lookups may run in several threads;
+   when two build the same table the first one published wins. */
+typedef struct {
+    char name[14];
+    uint16_t ino;              /* 0 marks an empty slot */
+} dirslot_t;
+
+typedef struct {
+    dirslot_t *slots;
+    uint32_t mask;
+    uint32_t count;
+} dirtable_t;
+
+typedef struct {
+    dirtable_t **tables;       /* by directory i-number, NULL until indexed */
+    uint32_t inode_count;
+} dir_index_t;
+
+static dir_index_t *dir_index_new(uint32_t inode_count) {
+    dir_index_t *dx = malloc(sizeof(dir_index_t));
+    if (!dx) return NULL;
+    dx->tables = calloc(inode_count + 1, sizeof(dirtable_t *));
+    if (!dx->tables) { free(dx); return NULL; }
+    dx->inode_count = inode_count;
+    return dx;
+}
+
+static void dir_index_free(dir_index_t *dx) {
+    if (!dx) return;
+    for (uint32_t i = 0; i <= dx->inode_count; i++) {
+        if (!dx->tables[i]) continue;
+        free(dx->tables[i]->slots);
+        free(dx->tables[i]);
+    }
+    free(dx->tables);
+    free(dx);
+}
+
+/* Normalize a name to the 14-byte key strncmp(.., 14) would compare. */
+static void dir_key(char key[14], const char *name) {
+    size_t n = strnlen(name, 14);
+    memcpy(key, name, n);
+    memset(key + n, 0, 14 - n);
+}
+
+static uint32_t dir_hash(const char key[14]) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 14; i++) { h ^= (unsigned char)key[i]; h *= 16777619u; }
+    return h;
+}
+
+static dirslot_t *dirtable_probe(dirslot_t *slots, uint32_t mask, const char key[14]) {
+    uint32_t i = dir_hash(key) & mask;
+    while (slots[i].ino != 0 && memcmp(slots[i].name, key, 14) != 0) i = (i + 1) & mask;
+    return &slots[i];
+}
+
+/* Insert unless the name is already present (first entry wins, as in a scan).
+   The table is kept at most half full. */
+static int dirtable_insert(dirtable_t *t, const char key[14], uint16_t ino) {
+    if ((t->count + 1) * 2 > t->mask + 1) {
+        uint32_t nmask = t->mask * 2 + 1;
+        dirslot_t *ns = calloc(nmask + 1, sizeof(dirslot_t));
+        if (!ns) return -1;
+        for (uint32_t i = 0; i <= t->mask; i++)
+            if (t->slots[i].ino) *dirtable_probe(ns, nmask, t->slots[i].name) = t->slots[i];
+        free(t->slots);
+        t->slots = ns;
+        t->mask = nmask;
+    }
+    dirslot_t *sl = dirtable_probe(t->slots, t->mask, key);
+    if (sl->ino != 0) return 0;
+    memcpy(sl->name, key, 14);
+    sl->ino = ino;
+    t->count++;
+    return 0;
+}
+
+static int dirtable_add_sector(dirtable_t *t, const unsigned char *blk) {
+    for (int e = 0; e < 32; e++) {
+        const unsigned char *ent = &blk[e*16];
+        uint16_t ent_ino = le16(ent);
+        if (ent_ino == 0) continue;
+        char key[14]; dir_key(key, (const char *)&ent[2]);
+        if (dirtable_insert(t, key, ent_ino) != 0) return -1;
+    }
+    return 0;
+}
+
+/* Build the table for directory inode din; returns 0 on success. */
+static int dirtable_build(image_t *disk, idisk_t *din, dirtable_t *t,
+                          uint32_t data_start, uint32_t data_end) {
+    t->slots = calloc(16, sizeof(dirslot_t));
+    if (!t->slots) return -1;
+    t->mask = 15;
+    t->count = 0;
+
+    const blockmap_t *bm = inode_blockmap(disk, din, data_start, data_end);
+    if (!bm) return -1;
+    unsigned char secbuf[512];
+    blockmap_iter_t it = BLOCKMAP_ITER(bm);
+    uint32_t sec;
+    while (blockmap_next(&it, &sec)) {
+        stat_kind(STAT_DIR);
+        const unsigned char *blk = read_sector(disk, sec, secbuf);
+        if (!blk) continue;
+        stat_add(entries, 32);
+        if (dirtable_add_sector(t, blk) != 0) return -1;
+    }
+    return 0;
+}
+
+/* Look name up in the index of directory dirino, indexing it on first use.
+   Returns the i-number, 0 if absent, or -1 if the index could not be built. */
+static int32_t dir_index_lookup(image_t *disk, inode_table_t *inodes, dir_index_t *dx,
+                                uint32_t dirino, const char *name,
+                                uint32_t data_start, uint32_t data_end) {
+    dirtable_t *t = __atomic_load_n(&dx->tables[dirino], __ATOMIC_ACQUIRE);
+    if (!t) {
+        t = calloc(1, sizeof(dirtable_t));
+        if (!t) return -1;
+        if (dirtable_build(disk, inode_at(inodes, dirino), t, data_start, data_end) != 0) {
+            free(t->slots);
+            free(t);
+            return -1;
+        }
+        dirtable_t *expected = NULL;
+        if (!__atomic_compare_exchange_n(&dx->tables[dirino], &expected, t, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(t->slots);
+            free(t);
+            t = expected;
+        }
+    }
+    char key[14]; dir_key(key, name);
+    return dirtable_probe(t->slots, t->mask, key)->ino;
+}
+
+/* Search directory 'dirino' for entry with given name; returns inode number or 0 if not found.
+   Uses inodes, disk, and computed data_start/data_end.  If dindex is non-NULL the
+   lookup goes through the directory index instead of scanning the blocks. */
+static uint16_t find_in_dir(image_t *disk, inode_table_t *inodes, uint32_t inode_count,
+                            dir_index_t *dindex, uint32_t dirino, const char *name,
+                            uint32_t inode_start_sector, uint32_t data_start, uint32_t data_end) {
+    if (dirino < 1 || dirino > inode_count) return 0;
+    idisk_t *din = inode_at(inodes, dirino);
+    const uint16_t IFMT = 060000;
+    const uint16_t IFDIR = 040000;
+    if ((din->i_mode & IFMT) != IFDIR) return 0;
+
+    if (dindex) {
+        int32_t found = dir_index_lookup(disk, inodes, dindex, dirino, name, data_start, data_end);
+        if (found >= 0) return (uint16_t)found;
+        /* out of memory: fall back to scanning */
+    }
+
+    unsigned char secbuf[512];
+    dirent_key_t key;
+    dirent_key_init(&key, name);
+
+    blockmap_iter_t it = BLOCKMAP_ITER(inode_blockmap(disk, din, data_start, data_end));
+    uint32_t sec;
+    while (blockmap_next(&it, &sec)) {
+        uint16_t found = check_sector(disk, (uint16_t)sec, secbuf, inodes, inode_count, &key, data_start, data_end);
+        if (found) return found;
+    }
+    return 0;
+}
+
+/* Resolve an absolute pathname to i-number. Returns 0 on not found / error. */
+static uint32_t resolve_pathname(image_t *disk, inode_table_t *inodes, uint32_t inode_count,
+                                 dir_index_t *dindex, const char *path,
+                                 uint32_t inode_start_sector, uint32_t data_start, uint32_t data_end) {
+    if (!path || path[0] != '/') return 0;
+    if (strcmp(path, "/") == 0) return 1;
+    // split path into components
+    char tmp[4096];
+    strncpy(tmp, path, sizeof(tmp)-1);
+    tmp[sizeof(tmp)-1] = 0;
+    char *save = NULL;
+    char *comp = strtok_r(tmp, "/", &save);
+    uint32_t cur = 1; // start at root
+    while (comp) {
+        uint16_t next = find_in_dir(disk, inodes, inode_count, dindex, cur, comp, inode_start_sector, data_start, data_end);
+        if (next == 0) return 0;
+        cur = next;
+        comp = strtok_r(NULL, "/", &save);
+    }
+    return cur;
+}
+
+/* Compute canonical absolute pathname of a directory inode (assumes inode is a directory).
+   Returns a malloc'd string (caller must free) or NULL on error. */
+static char *canonical_path(image_t *disk, inode_table_t *inodes, uint32_t inode_count,
+                            uint32_t target_inode,
+                            uint32_t inode_start_sector, uint32_t data_start, uint32_t data_end) {
+    if (target_inode < 1 || target_inode > inode_count) return NULL;
+    if (target_inode == 1) {
+        char *r = malloc(3); if (!r) return NULL; strcpy(r, "/"); strcat(r, "/"); return r; // return "/"
+    }
+    // store components in reverse
+    char **components = malloc((inode_count+2) * sizeof(char*));
+    if (!components) return NULL;
+    int compc = 0;
+    uint32_t cur = target_inode;
+    unsigned char secbuf[512];
+
+    while (cur != 1) {
+        // read '..' from current directory
+        uint16_t parent = 0;
+        bool found_dotdot = false;
+        blockmap_iter_t it = BLOCKMAP_ITER(inode_blockmap(disk, inode_at(inodes, cur), data_start, data_end));
+        uint32_t sec;
+        while (!found_dotdot && blockmap_next(&it, &sec)) {
+            stat_kind(STAT_DIR);
+            const unsigned char *blk = read_sector(disk, sec, secbuf);
+            if (!blk) continue;
+            stat_add(entries, 32);
+            uint32_t m = dirent_match(blk, &dotdot_key);
+            if (m) { parent = le16(&blk[__builtin_ctz(m) * 16]); found_dotdot = true; }
+        }
+        if (!found_dotdot || parent == 0) { // malformed
+            for (int i = 0; i < compc; i++) free(components[i]);
+            free(components);
+            return NULL;
+        }
+        // find in parent the entry that references cur (not '.' or '..')
+        bool found_name = false;
+        char foundnm[15]; memset(foundnm,0,sizeof(foundnm));
+        it = BLOCKMAP_ITER(inode_blockmap(disk, inode_at(inodes, parent), data_start, data_end));
+        while (!found_name && blockmap_next(&it, &sec)) {
+            stat_kind(STAT_DIR);
+            const unsigned char *blk = read_sector(disk, sec, secbuf);
+            if (!blk) continue;
+            stat_add(entries, 32);
+            for (int e = 0; e < 32; e++) {
+                const unsigned char *ent = &blk[e*16];
+                uint16_t ent_ino = le16(ent);
+                if (ent_ino != cur) continue;
+                char nm[15]; memset(nm,0,sizeof(nm)); memcpy(nm, &ent[2], 14);
+                if (strcmp(nm, ".") == 0 || strcmp(nm, "..") == 0) continue;
+                memcpy(foundnm, nm, 14);
+                found_name = true; break;
+            }
+        }
+        if (!found_name) {
+            // could be root link or missing; treat as error
+            for (int i = 0; i < compc; i++) free(components[i]);
+            free(components);
+            return NULL;
+        }
+        // push component
+        components[compc++] = strdup(foundnm);
+        cur = parent;
+    }
+
+    // assemble path; allocate enough space for trailing '/'
+    size_t total = 1; // leading '/'
+    for (int i = compc-1; i >= 0; i--) total += strlen(components[i]) + 1;
+    total += 1; // extra for trailing '/'
+    char *out = malloc(total + 1);
+    if (!out) {
+        for (int i = 0; i < compc; i++) free(components[i]);
+        free(components); return NULL;
+    }
+    out[0] = '/'; out[1] = 0;
+    for (int i = compc-1; i >= 0; i--) {
+        if (strlen(out) > 1) strcat(out, "/");
+        strcat(out, components[i]);
+    }
+    // ensure trailing '/'
+    size_t len = strlen(out);
+    if (len == 0 || out[len-1] != '/') {
+        strcat(out, "/");
+    }
+    // cleanup
+    for (int i = 0; i < compc; i++) free(components[i]);
+    free(components);
+    return out;
+}
+
+/* Call fn on each readable in-range block of directory din, in the order
+   the lookups above scan them, until fn returns true. */
+static void walk_dir_sectors(image_t *disk, idisk_t *din, uint32_t data_start, uint32_t data_end,
+                             bool (*fn)(const unsigned char *blk, void *arg), void *arg) {
+    unsigned char secbuf[512];
+    blockmap_iter_t it = BLOCKMAP_ITER(inode_blockmap(disk, din, data_start, data_end));
+    uint32_t sec;
+    while (blockmap_next(&it, &sec)) {
+        stat_kind(STAT_DIR);
+        const unsigned char *blk = read_sector(disk, sec, secbuf);
+        if (!blk) continue;
+        stat_add(entries, 32);
+        if (fn(blk, arg)) return;
+    }
+}
+
+/* Depth-first traversal engine shared by -l, -P, -a, -X and -c.  The
+   directories being walked live on an explicit stack of small frames
+   rather than the C stack, and a visited bitmap makes sure each directory
+   is entered at most once, so deep or cyclic images cost memory in
+   proportion to the path depth and can never recurse without bound.
+
+   visit() is called for every entry other than "." and "..", in directory
+   order, with the path of the entry (relative to the start directory) in
+   w->path: w->plen bytes of directory prefix ("" or ending in '/')
+   followed by the w->nlen byte name and a NUL; two more bytes may be
+   written past the name.  Returning WALK_DESCEND enters the entry if it
+   is a directory not yet entered; its frame then carries w->child_tag,
+   which visits inside it see as w->tag. */
+enum { WALK_NEXT, WALK_DESCEND, WALK_STOP };
+
+typedef struct {
+    uint16_t dirino;
+    uint8_t e;                 /* next entry in sector sec */
+    uint32_t sec;              /* sector being scanned, 0 before the first */
+    blockmap_iter_t it;
+    size_t plen;               /* length of this directory's prefix */
+    uint32_t tag;
+} walk_frame_t;
+
+typedef struct tree_walk {
+    image_t *disk;
+    inode_table_t *inodes;
+    uint32_t inode_count;
+    uint32_t data_start, data_end;
+    uint8_t *visited;          /* bitmap of directories entered */
+    walk_frame_t *stack;
+    size_t depth, cap;
+    char *path;
+    size_t plen, nlen, pcap;
+    uint32_t tag, child_tag;
+    bool failed;
+} tree_walk_t;
+
+typedef int (*walk_visit_fn)(tree_walk_t *w, uint16_t ino, void *arg);
+
+static void tree_walk_init(tree_walk_t *w, image_t *disk, inode_table_t *inodes, uint32_t inode_count,
+                           uint32_t data_start, uint32_t data_end) {
+    memset(w, 0, sizeof(*w));
+    w->disk = disk;
+    w->inodes = inodes;
+    w->inode_count = inode_count;
+    w->data_start = data_start;
+    w->data_end = data_end;
+}
+
+static void tree_walk_free(tree_walk_t *w) {
+    free(w->visited);
+    free(w->stack);
+    free(w->path);
+}
+
+static bool walk_reserve(tree_walk_t *w, size_t need) {
+    if (need <= w->pcap) return true;
+    size_t ncap = w->pcap ? w->pcap : 256;
+    while (ncap < need) ncap *= 2;
+    char *np = realloc(w->path, ncap);
+    if (!np) return false;
+    w->path = np;
+    w->pcap = ncap;
+    return true;
+}
+
+static bool walk_push(tree_walk_t *w, uint16_t dirino, size_t plen, uint32_t tag) {
+    if (w->depth == w->cap) {
+        size_t ncap = w->cap ? w->cap * 2 : 32;
+        walk_frame_t *ns = realloc(w->stack, ncap * sizeof(walk_frame_t));
+        if (!ns) return false;
+        w->stack = ns;
+        w->cap = ncap;
+    }
+    w->visited[dirino >> 3] |= (uint8_t)(1u << (dirino & 7));
+    const blockmap_t *bm = inode_blockmap(w->disk, inode_at(w->inodes, dirino), w->data_start, w->data_end);
+    w->stack[w->depth++] = (walk_frame_t){ dirino, 0, 0, BLOCKMAP_ITER(bm), plen, tag };
+    return true;
+}
+
+/* Walk the tree below directory root (whose entries are visited with tag
+   root_tag).  Returns 0 when done, -1 if stopped or out of memory. */
+static int tree_walk(tree_walk_t *w, uint32_t root, uint32_t root_tag, walk_visit_fn visit, void *arg) {
+    const uint16_t IFMT = 060000;
+    const uint16_t IFDIR = 040000;
+    if (root < 1 || root > w->inode_count) return 0;
+    if ((inode_mode(w->inodes, root) & IFMT) != IFDIR) return 0;
+    free(w->visited);
+    w->visited = calloc(w->inode_count / 8 + 1, 1);
+    w->depth = 0;
+    if (!w->visited || !walk_reserve(w, 16) || !walk_push(w, (uint16_t)root, 0, root_tag)) {
+        w->failed = true;
+        return -1;
+    }
+    w->path[0] = '\0';
+
+    unsigned char secbuf[512];
+    while (w->depth > 0) {
+        walk_frame_t *f = &w->stack[w->depth - 1];
+        if (f->sec == 0 || f->e == 32) {
+            if (!blockmap_next(&f->it, &f->sec)) { w->depth--; continue; }
+            f->e = 0;
+        }
+        stat_kind(STAT_DIR);
+        const unsigned char *blk = read_sector(w->disk, f->sec, secbuf);
+        if (!blk) { f->e = 32; continue; }
+        if (f->e == 0) stat_add(entries, 32);
+        uint32_t dots = dirent_match(blk, &dot_key) | dirent_match(blk, &dotdot_key);
+        while (f->e < 32) {
+            int e = f->e++;
+            uint16_t ent_ino = le16(&blk[e*16]);
+            if (ent_ino == 0 || ((dots >> e) & 1)) continue;
+            const char *nm = (const char *)&blk[e*16 + 2];
+            size_t nlen = strnlen(nm, 14);
+            if (!walk_reserve(w, f->plen + nlen + 2)) { w->failed = true; return -1; }
+            memcpy(w->path + f->plen, nm, nlen);
+            w->path[f->plen + nlen] = '\0';
+            w->plen = f->plen;
+            w->nlen = nlen;
+            w->tag = f->tag;
+            int r = visit(w, ent_ino, arg);
+            if (r == WALK_STOP) return -1;
+            if (r != WALK_DESCEND || ent_ino > w->inode_count) continue;
+            if ((inode_mode(w->inodes, ent_ino) & IFMT) != IFDIR) continue;
+            if (w->visited[ent_ino >> 3] & (1u << (ent_ino & 7))) continue;
+            w->path[f->plen + nlen] = '/';
+            size_t plen = f->plen + nlen + 1;
+            if (!walk_push(w, ent_ino, plen, w->child_tag)) { w->failed = true; return -1; }
+            break; /* continue with the child; this sector is re-read on return */
+        }
+    }
+    return 0;
+}
+
+/* Reverse-map table for -p: for every directory inode, the i-number its
+   ".." names and the name under which that parent lists it, i.e. exactly
+   what one step of canonical_path() would find.  Built in two passes over
+   the directories, after which reverse mapping needs no I/O. */
+typedef struct {
+    uint16_t *parent;          /* first ".." entry, 0 if none */
+    char (*name)[14];          /* name in parent; name[i][0] == 0 if none */
+    uint32_t inode_count;
+} parent_map_t;
+
+static void parent_map_free(parent_map_t *pm) {
+    if (!pm) return;
+    free(pm->parent);
+    free(pm->name);
+    free(pm);
+}
+
+static bool pm_take_dotdot(const unsigned char *blk, void *arg) {
+    uint32_t m = dirent_match(blk, &dotdot_key);
+    if (m) *(uint16_t *)arg = le16(&blk[__builtin_ctz(m) * 16]);
+    return m != 0;
+}
+
+typedef struct {
+    parent_map_t *pm;
+    inode_table_t *inodes;
+    uint32_t dirino;
+} pm_scan_t;
+
+static bool pm_take_names(const unsigned char *blk, void *arg) {
+    pm_scan_t *sc = arg;
+    parent_map_t *pm = sc->pm;
+    uint32_t dots = dirent_match(blk, &dot_key) | dirent_match(blk, &dotdot_key);
+    for (int e = 0; e < 32; e++) {
+        uint16_t ent_ino = le16(&blk[e*16]);
+        if (ent_ino == 0 || ent_ino > pm->inode_count || ((dots >> e) & 1)) continue;
+        if ((inode_mode(sc->inodes, ent_ino) & 060000) != 040000) continue;
+        if (pm->parent[ent_ino] != sc->dirino || pm->name[ent_ino][0]) continue;
+        memcpy(pm->name[ent_ino], &blk[e*16 + 2], 14);
+    }
+    return false;
+}
+
+static parent_map_t *parent_map_build(image_t *disk, inode_table_t *inodes, uint32_t inode_count,
+                                      uint32_t data_start, uint32_t data_end) {
+    parent_map_t *pm = calloc(1, sizeof(parent_map_t));
+    if (!pm) return NULL;
+    pm->inode_count = inode_count;
+    pm->parent = calloc(inode_count + 1, sizeof(uint16_t));
+    pm->name = calloc(inode_count + 1, sizeof(*pm->name));
+    if (!pm->parent || !pm->name) { parent_map_free(pm); return NULL; }
+
+    for (uint32_t ino = 1; ino <= inode_count; ino++) {
+        if ((inode_mode(inodes, ino) & 060000) != 040000) continue;
+        walk_dir_sectors(disk, inode_at(inodes, ino), data_start, data_end, pm_take_dotdot, &pm->parent[ino]);
+    }
+    pm_scan_t sc = { pm, inodes, 0 };
+    for (uint32_t ino = 1; ino <= inode_count; ino++) {
+        if ((inode_mode(inodes, ino) & 060000) != 040000) continue;
+        sc.dirino = ino;
+        walk_dir_sectors(disk, inode_at(inodes, ino), data_start, data_end, pm_take_names, &sc);
+    }
+    return pm;
+}
+
+/* canonical_path() answered from the parent map.  Sets *fallback and
+   returns NULL when the chain leaves the directories the map covers (a
+   corrupt ".." naming a non-directory), where only the scan gives the
+   historical answer. */
+static char *canonical_path_mapped(const parent_map_t *pm, inode_table_t *inodes,
+                                   uint32_t target_inode, bool *fallback) {
+    uint32_t inode_count = pm->inode_count;
+    *fallback = false;
+    if (target_inode < 1 || target_inode > inode_count) return NULL;
+    if (target_inode == 1) {
+        char *r = malloc(3); if (!r) return NULL; strcpy(r, "//"); return r;
+    }
+    /* first pass: validate the chain and size the result */
+    size_t total = 1;
+    uint32_t depth = 0;
+    for (uint32_t cur = target_inode; cur != 1; cur = pm->parent[cur]) {
+        if ((inode_mode(inodes, cur) & 060000) != 040000) { *fallback = true; return NULL; }
+        uint16_t parent = pm->parent[cur];
+        if (parent == 0 || parent > inode_count) return NULL;
+        if (!pm->name[cur][0]) return NULL;
+        if (++depth > inode_count) return NULL; // ".." cycle
+        total += strnlen(pm->name[cur], 14) + 1;
+    }
+    char *out = malloc(total + 1);
+    if (!out) return NULL;
+    /* second pass: fill in from the end */
+    size_t pos = total;
+    out[pos] = '\0';
+    out[--pos] = '/';
+    for (uint32_t cur = target_inode; cur != 1; cur = pm->parent[cur]) {
+        size_t n = strnlen(pm->name[cur], 14);
+        pos -= n;
+        memcpy(out + pos, pm->name[cur], n);
+        out[--pos] = '/';
+    }
+    return out;
+}
+
+/* Inverted index from i-number to every directory entry naming it, built
+   by one tree_walk() from the root in -l order.  Entries form a tree (each
+   node points at the node of the directory it was found in), so a path is
+   rebuilt by following parents and only 14 name bytes are stored per
+   entry.  Directories are expanded under the first path that reaches them. */
+typedef struct {
+    uint32_t parent;           /* node of the containing directory */
+    uint32_t next;             /* next node naming the same inode, 0 ends */
+    uint16_t ino;
+    char name[14];
+} link_node_t;
+
+typedef struct {
+    link_node_t *nodes;        /* nodes[0] is the root */
+    uint32_t count, cap;
+    uint32_t *head, *tail;     /* per inode, in traversal order; 0 if none */
+    uint32_t inode_count;
+} link_index_t;
+
+static void link_index_free(link_index_t *li) {
+    if (!li) return;
+    free(li->nodes);
+    free(li->head);
+    free(li->tail);
+    free(li);
+}
+
+static int link_visit(tree_walk_t *w, uint16_t ino, void *arg) {
+    link_index_t *li = arg;
+    if (ino > li->inode_count) return WALK_NEXT;
+    if (li->count == li->cap) {
+        uint32_t ncap = li->cap * 2;
+        link_node_t *n = realloc(li->nodes, ncap * sizeof(link_node_t));
+        if (!n) return WALK_STOP;
+        li->nodes = n; li->cap = ncap;
+    }
+    uint32_t id = li->count++;
+    link_node_t *nd = &li->nodes[id];
+    nd->parent = w->tag;
+    nd->next = 0;
+    nd->ino = ino;
+    memset(nd->name, 0, 14);
+    memcpy(nd->name, w->path + w->plen, w->nlen);
+    if (li->tail[ino]) li->nodes[li->tail[ino]].next = id;
+    else li->head[ino] = id;
+    li->tail[ino] = id;
+    w->child_tag = id;
+    return WALK_DESCEND;
+}
+
+static link_index_t *link_index_build(image_t *disk, inode_table_t *inodes, uint32_t inode_count,
+                                      uint32_t data_start, uint32_t data_end) {
+    if (inode_count < 1) return NULL;
+    link_index_t *li = calloc(1, sizeof(link_index_t));
+    if (!li) return NULL;
+    li->inode_count = inode_count;
+    li->cap = inode_count + 1;
+    li->nodes = malloc(li->cap * sizeof(link_node_t));
+    li->head = calloc(inode_count + 1, sizeof(uint32_t));
+    li->tail = calloc(inode_count + 1, sizeof(uint32_t));
+    if (!li->nodes || !li->head || !li->tail) { link_index_free(li); return NULL; }
+
+    li->nodes[0] = (link_node_t){ .parent = 0, .next = 0, .ino = 1 };
+    li->count = 1;
+    tree_walk_t w;
+    tree_walk_init(&w, disk, inodes, inode_count, data_start, data_end);
+    int rc = tree_walk(&w, 1, 0, link_visit, li);
+    tree_walk_free(&w);
+    free(li->tail); li->tail = NULL;
+    if (rc != 0) { link_index_free(li); return NULL; }
+    return li;
+}
+
+/* Scratch for link_print_dir(): the nodes from a directory up to the
+   root, grown as deeper paths need it. */
+typedef struct {
+    uint32_t *ids;
+    size_t cap;
+    bool failed;               /* out of memory */
+} link_chain_t;
+
+/* Print the directory part of node's path, i.e. everything up to and
+   including the '/' before its name.  The parent chain is collected first
+   and printed from the root down, so depth costs memory, not stack. */
+static void link_print_dir(const link_index_t *li, uint32_t node, link_chain_t *ch, FILE *out) {
+    size_t depth = 0;
+    for (; node != 0; node = li->nodes[node].parent) {
+        if (depth == ch->cap) {
+            size_t ncap = ch->cap ? ch->cap * 2 : 32;
+            uint32_t *n = realloc(ch->ids, ncap * sizeof(uint32_t));
+            if (!n) { ch->failed = true; return; }
+            ch->ids = n; ch->cap = ncap;
+        }
+        ch->ids[depth++] = node;
+    }
+    fputc('/', out);
+    while (depth > 0) fprintf(out, "%.14s/", li->nodes[ch->ids[--depth]].name);
+}
+
+/* Print every pathname of ino, one per line, prefixed with the i-number
+   when with_inum is set.  Directories keep -l's trailing '/'.  Returns the
+   number of paths printed; ch->failed is set if memory ran out. */
+static uint32_t link_print_paths(const link_index_t *li, inode_table_t *inodes, uint32_t ino,
+                                 bool with_inum, link_chain_t *ch, FILE *out) {
+    uint32_t n = 0;
+    bool isdir = (inode_mode(inodes, ino) & 060000) == 040000;
+    if (ino == 1) {
+        if (with_inum) fprintf(out, "%u ", ino);
+        fputs("/\n", out);
+        n++;
+    }
+    for (uint32_t id = li->head[ino]; id != 0 && !ch->failed; id = li->nodes[id].next) {
+        if (with_inum) fprintf(out, "%u ", ino);
+        link_print_dir(li, li->nodes[id].parent, ch, out);
+        if (ch->failed) break;
+        fprintf(out, "%.14s%s\n", li->nodes[id].name, isdir ? "/" : "");
+        n++;
+    }
+    return n;
+}
+
+/* Output buffer for listings: lines are assembled in place and handed to
+   the stream LIST_OUTBUF bytes at a time. */
+#define LIST_OUTBUF (64 * 1024)
+
+typedef struct {
+    FILE *out;
+    char *buf;
+    size_t len;
+    bool failed;
+} list_t;
+
+static void list_flush(list_t *ls) {
+    stat_phase_enter(STAT_PH_OUTPUT);
+    if (ls->len && fwrite(ls->buf, 1, ls->len, ls->out) != ls->len) ls->failed = true;
+    ls->len = 0;
+    stat_phase_leave();
+}
+
+/* Emit the n bytes at line, then suffix and '\n', as one line. */
+static void list_line(list_t *ls, const char *line, size_t n, const char *suffix, size_t slen) {
+    size_t need = n + slen + 1;
+    if (ls->len + need > LIST_OUTBUF) list_flush(ls);
+    if (need > LIST_OUTBUF) {
+        /* longer than the whole buffer: write it piecewise */
+        stat_phase_enter(STAT_PH_OUTPUT);
+        if (fwrite(line, 1, n, ls->out) != n || fwrite(suffix, 1, slen, ls->out) != slen ||
+            fputc('\n', ls->out) == EOF)
+            ls->failed = true;
+        stat_phase_leave();
+        return;
+    }
+    char *p = ls->buf + ls->len;
+    memcpy(p, line, n); p += n;
+    memcpy(p, suffix, slen); p += slen;
+    *p = '\n';
+    ls->len += need;
+}
+
+static int list_visit(tree_walk_t *w, uint16_t ino, void *arg) {
+    list_t *ls = arg;
+    size_t n = w->plen + w->nlen;
+    bool isdir = ino <= w->inode_count && (inode_mode(w->inodes, ino) & 060000) == 040000;
+    if (!isdir) {
+        list_line(ls, w->path, n, "", 0);
+    } else {
+        list_line(ls, w->path, n, "/", 1);
+        list_line(ls, w->path, n, "/../", 4);
+        list_line(ls, w->path, n, "/./", 3);
+    }
+    return ls->failed ? WALK_STOP : WALK_DESCEND;
+}
+
+/* List the hierarchy below dirino to out (-l): "../" and "./", then every
+   entry in depth-first order, directories followed by their "/../" and
+   "/./" lines and their contents.  Returns 0 on success. */
+static int list_tree(image_t *disk, inode_table_t *inodes, uint32_t inode_count, uint32_t dirino, FILE *out,
+                     uint32_t inode_start_sector, uint32_t data_start, uint32_t data_end) {
+    if (dirino < 1 || dirino > inode_count) return 0;
+    if ((inode_mode(inodes, dirino) & 060000) != 040000) return 0;
+    list_t ls = { out, malloc(LIST_OUTBUF), 0, false };
+    if (!ls.buf) return -1;
+    list_line(&ls, "..", 2, "/", 1);
+    list_line(&ls, ".", 1, "/", 1);
+    tree_walk_t w;
+    tree_walk_init(&w, disk, inodes, inode_count, data_start, data_end);
+    if (tree_walk(&w, dirino, 0, list_visit, &ls) != 0) ls.failed = true;
+    tree_walk_free(&w);
+    list_flush(&ls);
+    free(ls.buf);
+    return ls.failed ? -1 : 0;
+}
+
+/* Extraction state.  Physically consecutive data blocks are gathered into
+   one extent [start, start + len) and written with as few calls as the two
+   ends allow: copy_file_range() or sendfile() between descriptors, a single
+   fwrite() from a mapped image, or 64 KiB pread()s otherwise. */
+typedef struct {
+    image_t *disk;
+    FILE *out;
+    uint32_t size;             /* bytes the file still has to produce */
+    uint32_t start;            /* first sector of the pending extent */
+    uint32_t len;              /* bytes pending */
+} extract_t;
+
+/* Move len bytes at image offset off straight to outfd.  Returns the number
+   of bytes moved; short only if the kernel declined the pair of files. */
+static size_t extract_zerocopy(int infd, int outfd, off_t off, size_t len) {
+    size_t done = 0;
+    bool use_cfr = true;
+    while (done < len) {
+        ssize_t n;
+        if (use_cfr) {
+            loff_t in_off = off + (off_t)done;
+            n = copy_file_range(infd, &in_off, outfd, NULL, len - done, 0);
+            if (n < 0 && errno != EINTR) { use_cfr = false; continue; }
+        } else {
+            off_t in_off = off + (off_t)done;
+            n = sendfile(outfd, infd, &in_off, len - done);
+            if (n < 0 && errno != EINTR) break;
+        }
+        if (n == 0) break;
+        if (n > 0) done += (size_t)n;
+    }
+    return done;
+}
+
+static int extract_write(image_t *disk, FILE *out, off_t off, size_t len) {
+    size_t done = 0;
+    int outfd = fileno(out);
+    if (len >= EXTRACT_ZEROCOPY_MIN && disk->fd >= 0 && outfd >= 0) {
+        if (fflush(out) != 0) return -1;
+        done = extract_zerocopy(disk->fd, outfd, off, len);
+    }
+    if (done == len) return 0;
+    if (disk->base) {
+        if (fwrite(disk->base + off + done, 1, len - done, out) != len - done) return -1;
+        return 0;
+    }
+    if (disk->fd < 0) {
+        unsigned char secbuf[512];
+        for (; done < len; done += 512) {
+            stat_kind(STAT_DATA);
+            const unsigned char *blk = read_sector(disk, (uint32_t)((off + (off_t)done) / 512), secbuf);
+            size_t n = len - done < 512 ? len - done : 512;
+            if (!blk || fwrite(blk, 1, n, out) != n) return -1;
+        }
+        return 0;
+    }
+    unsigned char buf[64 * 1024];
+    while (done < len) {
+        size_t want = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        ssize_t n = pread(disk->fd, buf, want, off + (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        if (fwrite(buf, 1, (size_t)n, out) != (size_t)n) return -1;
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static int extract_flush(extract_t *x) {
+    if (x->len == 0) return 0;
+    size_t len = x->len;
+    x->len = 0;
+    stat_phase_enter(STAT_PH_OUTPUT);
+    int r = extract_write(x->disk, x->out, (off_t)x->start * SECTOR_SIZE, len);
+#ifdef STATS
+    /* read_sector() counted its own reads; the other paths bypass it */
+    if (r == 0 && (x->disk->base || x->disk->fd >= 0)) {
+        stat_kind(STAT_DATA);
+        stat_sectors((len + 511) / 512);
+    }
+#endif
+    stat_phase_leave();
+    return r;
+}
+
+/* Append count data blocks from start to the output, merging them into the
+   pending extent when they continue it. */
+static int extract_data(extract_t *x, uint32_t start, uint32_t count) {
+    uint32_t bytes = count * 512 < x->size ? count * 512 : x->size;
+    if (x->len % 512 != 0 || start != x->start + x->len / 512) {
+        if (extract_flush(x) != 0) return -1;
+        x->start = start;
+    }
+    x->len += bytes;
+    x->size -= bytes;
+    return 0;
+}
+
+/* Write file contents to out (stdout for the CLI) for a given file inode. Returns 0 on success, -1 on error. */
+static int extract_file_to_stdout(image_t *disk, inode_table_t *inodes, uint32_t inode_count,
+                                  uint32_t ino, FILE *out,
+                                  uint32_t inode_start_sector, uint32_t data_start, uint32_t data_end) {
+    if (ino < 1 || ino > inode_count) return -1;
+    idisk_t *fino = inode_at(inodes, ino);
+    uint16_t mode = fino->i_mode;
+    uint16_t IFMT = 060000;
+    uint16_t IFDIR = 040000;
+    uint16_t IFCHR = 020000;
+    uint16_t IFBLK = 060000;
+    if ((mode & IFMT) == IFDIR) return -1; // not a regular file
+    if ((mode & IFMT) == IFCHR || (mode & IFMT) == IFBLK) return -1;
+    const blockmap_t *bm = inode_blockmap(disk, fino, data_start, data_end);
+    if (!bm) return -1;
+    extract_t x = { disk, out, inode_size_bytes(fino), 0, 0 };
+
+    /* holes are left out and do not count towards the size, so the output
+       is the allocated blocks in order, i_size bytes of them at most (as -x
+       has always done; the range path below reads holes as zeros instead).
+       A bad address ends the file with an error once everything before it
+       has been written */
+    for (uint32_t i = 0; i < bm->n && x.size > 0; i++) {
+        const extent_t *ext = &bm->ext[i];
+        if (ext->kind == BLOCKMAP_HOLE) continue;
+        if (ext->kind == BLOCKMAP_BAD) { extract_flush(&x); return -1; }
+        if (extract_data(&x, ext->start, ext->count) != 0) return -1;
+    }
+    return extract_flush(&x);
+}
+
+/* Copy bytes [off, off+len) of inode in into buf, holes as zeros, for
+   dosiero_read() and -x --offset/--length.  Each block is located from
+   its i_addr slot (and indirect entry) with blockmap_lookup(), so only
+   the sectors holding the range are read, however far into the file it
+   lies.  Returns the bytes copied, short only before a bad block, or -1
+   if the first block is bad or unreadable. */
+static ssize_t inode_pread(image_t *disk, idisk_t *in, void *buf, size_t len, uint64_t off,
+                           uint32_t data_start, uint32_t data_end) {
+    uint32_t size = inode_size_bytes(in);
+    if (off >= size) return 0;
+    if (len > size - off) len = size - off;
+    blockmap_cursor_t cur;
+    blockmap_cursor_init(&cur, disk, in->i_mode, in->i_addr, data_start, data_end);
+    unsigned char *dst = buf;
+    unsigned char secbuf[512];
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = off + done;
+        uint32_t skip = (uint32_t)(pos % 512);
+        size_t n = 512 - skip;
+        if (n > len - done) n = len - done;
+        uint16_t sec;
+        int kind = blockmap_lookup(&cur, (uint32_t)(pos / 512), &sec);
+        const unsigned char *blk = NULL;
+        if (kind == BLOCKMAP_DATA) {
+            stat_kind(STAT_DATA);
+            blk = read_sector(disk, sec, secbuf);
+        }
+        if (kind == BLOCKMAP_HOLE) memset(dst + done, 0, n);
+        else if (blk) memcpy(dst + done, blk + skip, n);
+        else break;
+        done += n;
+    }
+    if (done == 0 && len > 0) { errno = EIO; return -1; }
+    return (ssize_t)done;
+}
+
+/* Streaming archive writer for -a.  Output is queued as iovecs pointing at
+   header blocks, mapped sectors or padding, and written with one writev()
+   per ARCHIVE_BATCH pieces, so memory use is fixed whatever the image size.
+   bufs holds headers and sectors that had to be copied (pread backend). */
+#define ARCHIVE_BATCH 256
+
+typedef struct archive_pipe archive_pipe_t;
+
+typedef struct {
+    FILE *out;
+    int fd;                        /* -1 if out has no descriptor */
+    struct iovec iov[ARCHIVE_BATCH];
+    int niov;
+    unsigned char (*bufs)[512];
+    int nbufs;
+    bool failed;
+    archive_pipe_t *pipe;          /* hand records to workers instead */
+} archive_t;
+
+static const unsigned char zero_block[512];
+
+static void archive_flush(archive_t *ar) {
+    if (ar->niov == 0) return;
+    stat_phase_enter(STAT_PH_OUTPUT);
+    if (ar->fd < 0) {
+        for (int i = 0; i < ar->niov && !ar->failed; i++)
+            if (fwrite(ar->iov[i].iov_base, 1, ar->iov[i].iov_len, ar->out) != ar->iov[i].iov_len)
+                ar->failed = true;
+    } else {
+        struct iovec *iov = ar->iov;
+        int n = ar->niov;
+        while (n > 0 && !ar->failed) {
+            ssize_t w = writev(ar->fd, iov, n);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) { ar->failed = true; break; }
+            while (n > 0 && (size_t)w >= iov->iov_len) { w -= iov->iov_len; iov++; n--; }
+            if (n > 0) { iov->iov_base = (char *)iov->iov_base + w; iov->iov_len -= w; }
+        }
+    }
+    ar->niov = 0;
+    ar->nbufs = 0;
+    stat_phase_leave();
+}
+
+/* Hand out a scratch block; guarantees room for the push that follows. */
+static unsigned char *archive_buf(archive_t *ar) {
+    if (ar->niov == ARCHIVE_BATCH || ar->nbufs == ARCHIVE_BATCH) archive_flush(ar);
+    return ar->bufs[ar->nbufs++];
+}
+
+static void archive_push(archive_t *ar, const void *p, size_t len) {
+    if (ar->niov == ARCHIVE_BATCH) archive_flush(ar);
+    ar->iov[ar->niov].iov_base = (void *)p;
+    ar->iov[ar->niov].iov_len = len;
+    ar->niov++;
+}
+
+static void tar_octal(char *field, size_t width, uint32_t val) {
+    snprintf(field, width, "%0*o", (int)width - 1, (unsigned)val);
+}
+
+static void archive_header(archive_t *ar, const char *name, const char *prefix,
+                           char type, uint16_t mode, uint8_t uid, uint8_t gid,
+                           uint32_t size, uint32_t mtime, uint16_t dev) {
+    unsigned char *h = archive_buf(ar);
+    memset(h, 0, 512);
+    strncpy((char *)h, name, 100);
+    tar_octal((char *)h + 100, 8, mode & 07777);
+    tar_octal((char *)h + 108, 8, uid);
+    tar_octal((char *)h + 116, 8, gid);
+    tar_octal((char *)h + 124, 12, size);
+    tar_octal((char *)h + 136, 12, mtime);
+    h[156] = (unsigned char)type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    if (type == '3' || type == '4') {
+        tar_octal((char *)h + 329, 8, dev >> 8);
+        tar_octal((char *)h + 337, 8, dev & 0377);
+    }
+    if (prefix) strncpy((char *)h + 345, prefix, 155);
+    memset(h + 148, ' ', 8);
+    uint32_t sum = 0;
+    for (int i = 0; i < 512; i++) sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", (unsigned)sum);
+    archive_push(ar, h, 512);
+}
+
+/* Emit the ustar header(s) for path, splitting it into prefix/name or, if
+   that is impossible, preceding it with a GNU long-name record. */
+static void archive_entry(archive_t *ar, const char *path, char type, const idisk_t *in, uint32_t size) {
+    size_t len = strlen(path);
+    char prefix[156] = "";
+    const char *name = path;
+    if (len > 100) {
+        const char *cut = NULL;
+        for (const char *q = path; (q = strchr(q, '/')) != NULL; q++) {
+            if (q == path + len - 1) break;  /* trailing '/' of a directory */
+            if ((size_t)(q - path) <= 155 && len - (size_t)(q - path) - 1 <= 100) { cut = q; break; }
+        }
+        if (cut) {
+            memcpy(prefix, path, (size_t)(cut - path));
+            prefix[cut - path] = '\0';
+            name = cut + 1;
+        } else {
+            archive_header(ar, "././@LongLink", NULL, 'L', 0644, 0, 0, (uint32_t)len + 1, 0, 0);
+            for (size_t off = 0; off <= len; off += 512) {
+                unsigned char *b = archive_buf(ar);
+                memset(b, 0, 512);
+                memcpy(b, path + off, (len + 1 - off) < 512 ? (len + 1 - off) : 512);
+                archive_push(ar, b, 512);
+            }
+        }
+    }
+    archive_header(ar, name, prefix[0] ? prefix : NULL, type, in->i_mode, in->i_uid, in->i_gid,
+                   size, in->i_mtime, in->i_addr[0]);
+}
+
+/* Queue one data block of a file; unreadable or unallocated blocks are
+   stored as zeros so the record always matches its header size. */
+static void archive_block(archive_t *ar, image_t *disk, uint16_t sec, uint32_t len,
+                          uint32_t data_start, uint32_t data_end) {
+    const unsigned char *blk = zero_block;
+    if (sec != 0 && sec >= data_start && sec <= data_end) {
+        unsigned char *b = archive_buf(ar);
+        stat_kind(STAT_DATA);
+        blk = read_sector(disk, sec, b);
+        if (blk != b) ar->nbufs--;  /* mapped: the slot was not needed */
+        if (!blk) blk = zero_block;
+    }
+    archive_push(ar, blk, len);
+    if (len < 512) archive_push(ar, zero_block, 512 - len);
+}
+
+static void archive_file(archive_t *ar, image_t *disk, idisk_t *fino,
+                         uint32_t data_start, uint32_t data_end) {
+    uint32_t sz = inode_size_bytes(fino);
+    uint32_t written = 0;
+    const blockmap_t *bm = inode_blockmap(disk, fino, data_start, data_end);
+    for (uint32_t i = 0; bm && i < bm->n && written < sz; i++) {
+        const extent_t *ext = &bm->ext[i];
+        for (uint32_t j = 0; j < ext->count && written < sz; j++) {
+            uint32_t len = (sz - written > 512) ? 512U : (sz - written);
+            uint16_t sec = ext->kind == BLOCKMAP_DATA ? (uint16_t)(ext->start + j) : 0;
+            archive_block(ar, disk, sec, len, data_start, data_end);
+            written += len;
+        }
+    }
+    /* pad a truncated block map out to the recorded size */
+    for (; written < sz; ) {
+        uint32_t len = (sz - written > 512) ? 512U : (sz - written);
+        archive_block(ar, disk, 0, len, data_start, data_end);
+        written += len;
+    }
+}
+
+/* Emit the complete record (headers and payload) for one entry. */
+static void archive_record(archive_t *ar, image_t *disk, const char *path, idisk_t *in,
+                           uint32_t data_start, uint32_t data_end) {
+    const uint16_t IFMT = 060000;
+    const uint16_t IFDIR = 040000;
+    const uint16_t IFCHR = 020000;
+    const uint16_t IFBLK = 060000;
+    uint16_t fmt = in->i_mode & IFMT;
+    if (fmt == IFDIR) {
+        archive_entry(ar, path, '5', in, 0);
+    } else if (fmt == IFCHR || fmt == IFBLK) {
+        archive_entry(ar, path, fmt == IFCHR ? '3' : '4', in, 0);
+    } else {
+        archive_entry(ar, path, '0', in, inode_size_bytes(in));
+        archive_file(ar, disk, in, data_start, data_end);
+    }
+}
+
+/* Parallel -a: the tree walk submits records in order into a window of
+   ARCHIVE_WINDOW slots, worker threads pack them into memory concurrently,
+   and a writer thread emits finished slots strictly in submission order,
+   so the archive is byte-identical to the sequential one.  The records in
+   the window hold at most ARCHIVE_WINDOW_BYTES between them, except that
+   one record is always let in, however large. */
+#define ARCHIVE_WINDOW 64
+#define ARCHIVE_WINDOW_BYTES (4u << 20)
+
+enum { SLOT_FREE, SLOT_QUEUED, SLOT_DONE };
+
+typedef struct {
+    int state;
+    char *path;
+    idisk_t *in;
+    char *data;
+    size_t len;
+    size_t size;                   /* archive_record_size() */
+} archive_job_t;
+
+struct archive_pipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    archive_job_t jobs[ARCHIVE_WINDOW];
+    uint64_t submitted, next_pack, next_emit;
+    size_t window_bytes;           /* sum of size over submitted, unemitted jobs */
+    bool done, failed;
+    image_t *disk;
+    uint32_t data_start, data_end;
+    FILE *out;
+};
+
+/* Bytes archive_record() emits for path: the header, a long-name record
+   if the path may need one, and a regular file's padded payload. */
+static size_t archive_record_size(const char *path, const idisk_t *in) {
+    size_t len = strlen(path);
+    size_t size = 512;
+    if (len > 100) size += 512 + (len + 1 + 511) / 512 * 512;
+    uint16_t fmt = in->i_mode & 060000;
+    if (fmt != 040000 && fmt != 020000 && fmt != 060000)
+        size += ((size_t)inode_size_bytes(in) + 511) / 512 * 512;
+    return size;
+}
+
+static void archive_pipe_submit(archive_pipe_t *pp, const char *path, idisk_t *in) {
+    char *copy = strdup(path);
+    size_t size = archive_record_size(path, in);
+    pthread_mutex_lock(&pp->lock);
+    while (pp->submitted - pp->next_emit >= ARCHIVE_WINDOW ||
+           (pp->submitted != pp->next_emit && pp->window_bytes + size > ARCHIVE_WINDOW_BYTES))
+        pthread_cond_wait(&pp->cond, &pp->lock);
+    archive_job_t *job = &pp->jobs[pp->submitted % ARCHIVE_WINDOW];
+    job->path = copy;
+    job->in = in;
+    job->size = size;
+    job->state = SLOT_QUEUED;
+    pp->window_bytes += size;
+    if (!copy) pp->failed = true;
+    pp->submitted++;
+    pthread_cond_broadcast(&pp->cond);
+    pthread_mutex_unlock(&pp->lock);
+}
+
+static void *archive_pack_worker(void *arg) {
+    archive_pipe_t *pp = arg;
+    archive_t ar;
+    memset(&ar, 0, sizeof(ar));
+    ar.fd = -1;
+    ar.bufs = malloc(ARCHIVE_BATCH * sizeof(*ar.bufs));
+    for (;;) {
+        pthread_mutex_lock(&pp->lock);
+        while (pp->next_pack == pp->submitted && !pp->done) pthread_cond_wait(&pp->cond, &pp->lock);
+        if (pp->next_pack == pp->submitted) { pthread_mutex_unlock(&pp->lock); break; }
+        archive_job_t *job = &pp->jobs[pp->next_pack++ % ARCHIVE_WINDOW];
+        pthread_mutex_unlock(&pp->lock);
+
+        char *data = NULL;
+        size_t len = 0;
+        bool ok = false;
+        if (ar.bufs && job->path && (ar.out = open_memstream(&data, &len)) != NULL) {
+            ar.failed = false;
+            archive_record(&ar, pp->disk, job->path, job->in, pp->data_start, pp->data_end);
+            archive_flush(&ar);
+            ok = !ar.failed;
+            fclose(ar.out);
+        }
+
+        pthread_mutex_lock(&pp->lock);
+        job->data = data;
+        job->len = len;
+        job->state = SLOT_DONE;
+        if (!ok) pp->failed = true;
+        pthread_cond_broadcast(&pp->cond);
+        pthread_mutex_unlock(&pp->lock);
+    }
+    free(ar.bufs);
+    return NULL;
+}
+
+static void *archive_emit_worker(void *arg) {
+    archive_pipe_t *pp = arg;
+    for (;;) {
+        pthread_mutex_lock(&pp->lock);
+        archive_job_t *job = &pp->jobs[pp->next_emit % ARCHIVE_WINDOW];
+        while (!(pp->next_emit < pp->submitted && job->state == SLOT_DONE) &&
+               !(pp->next_emit == pp->submitted && pp->done))
+            pthread_cond_wait(&pp->cond, &pp->lock);
+        if (pp->next_emit == pp->submitted) { pthread_mutex_unlock(&pp->lock); break; }
+        pthread_mutex_unlock(&pp->lock);
+
+        bool ok = !job->len || fwrite(job->data, 1, job->len, pp->out) == job->len;
+        free(job->data);
+        free(job->path);
+
+        pthread_mutex_lock(&pp->lock);
+        job->data = NULL;
+        job->path = NULL;
+        job->state = SLOT_FREE;
+        if (!ok) pp->failed = true;
+        pp->window_bytes -= job->size;
+        pp->next_emit++;
+        pthread_cond_broadcast(&pp->cond);
+        pthread_mutex_unlock(&pp->lock);
+    }
+    return NULL;
+}
+
+/* tree_walk() visitor for -a: one record per allocated entry, named by its
+   path relative to the root (directories with a trailing '/'). */
+static int archive_visit(tree_walk_t *w, uint16_t ino, void *arg) {
+    archive_t *ar = arg;
+    if (ar->failed) return WALK_STOP;
+    if (ino > w->inode_count) return WALK_NEXT;
+    idisk_t *in = inode_at(w->inodes, ino);
+    if (!(in->i_mode & 0100000)) return WALK_NEXT;
+    size_t len = w->plen + w->nlen;
+    bool isdir = (in->i_mode & 060000) == 040000;
+    if (isdir) {
+        w->path[len] = '/';
+        w->path[len + 1] = '\0';
+    }
+    if (ar->pipe) archive_pipe_submit(ar->pipe, w->path, in);
+    else archive_record(ar, w->disk, w->path, in, w->data_start, w->data_end);
+    return isdir ? WALK_DESCEND : WALK_NEXT;
+}
+
+/* Serialize the whole hierarchy below the root to out as a ustar archive,
+   packing records on worker threads when the image allows it.
+   Returns 0 on success, -1 on error. */
+static int archive_hierarchy(image_t *disk, inode_table_t *inodes, uint32_t inode_count, FILE *out,
+                             uint32_t data_start, uint32_t data_end) {
+    archive_t ar;
+    memset(&ar, 0, sizeof(ar));
+    ar.out = out;
+    ar.bufs = malloc(ARCHIVE_BATCH * sizeof(*ar.bufs));
+    if (!ar.bufs) return -1;
+    fflush(out);
+    ar.fd = fileno(out);
+
+    archive_pipe_t *pp = NULL;
+    pthread_t tids[MAX_WORKER_THREADS + 1];
+    int started = 0;
+    int nworkers = worker_threads();
+    if (nworkers > 1 && (pp = calloc(1, sizeof(archive_pipe_t))) != NULL) {
+        pthread_mutex_init(&pp->lock, NULL);
+        pthread_cond_init(&pp->cond, NULL);
+        pp->disk = disk;
+        pp->data_start = data_start;
+        pp->data_end = data_end;
+        pp->out = out;
+        if (pthread_create(&tids[started], NULL, archive_emit_worker, pp) == 0) started++;
+        while (started && started <= nworkers &&
+               pthread_create(&tids[started], NULL, archive_pack_worker, pp) == 0) started++;
+        if (started < 2) {
+            /* need the writer and at least one packer */
+            pthread_mutex_lock(&pp->lock);
+            pp->done = true;
+            pthread_cond_broadcast(&pp->cond);
+            pthread_mutex_unlock(&pp->lock);
+            for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+            started = 0;
+        } else {
+            ar.pipe = pp;
+        }
+    }
+
+    tree_walk_t w;
+    tree_walk_init(&w, disk, inodes, inode_count, data_start, data_end);
+    if (tree_walk(&w, 1, 0, archive_visit, &ar) != 0 && w.failed) ar.failed = true;
+    tree_walk_free(&w);
+
+    if (ar.pipe) {
+        pthread_mutex_lock(&pp->lock);
+        pp->done = true;
+        pthread_cond_broadcast(&pp->cond);
+        pthread_mutex_unlock(&pp->lock);
+        for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+        fflush(out);
+        if (pp->failed) ar.failed = true;
+    }
+    if (pp) {
+        pthread_mutex_destroy(&pp->lock);
+        pthread_cond_destroy(&pp->cond);
+        free(pp);
+    }
+    /* end-of-archive marker: two zero blocks */
+    archive_push(&ar, zero_block, 512);
+    archive_push(&ar, zero_block, 512);
+    archive_flush(&ar);
+    free(ar.bufs);
+    return ar.failed ? -1 : 0;
+}
+
+/* Subtree extraction for -X.  The subtree is walked once, in -l order,
+   into a flat plan of directories and files; all directories are then
+   created in one sequential pass (parents first), after which the files
+   are written by a pool of threads that claim plan entries in order.
+   Device nodes are skipped, hard links are written as separate copies and
+   every directory is entered at most once.  Entries the host cannot name
+   are reported and left out with their subtrees, and -X then fails. */
+typedef struct {
+    char *path;                /* relative to the destination directory */
+    uint16_t ino;
+    bool isdir;
+} restore_item_t;
+
+typedef struct {
+    restore_item_t *items;
+    size_t count, cap;
+    const char *dest;
+    bool failed;
+    bool skipped;              /* something below could not be restored */
+} restore_plan_t;
+
+typedef struct {
+    image_t *disk;
+    inode_table_t *inodes;
+    uint32_t inode_count;
+    uint32_t data_start, data_end;
+    const char *dest;
+    restore_plan_t *plan;
+    size_t next;               /* next plan entry to claim */
+    bool failed;
+} restore_t;
+
+static int restore_add(restore_plan_t *pl, const char *path, uint16_t ino, bool isdir) {
+    if (pl->count == pl->cap) {
+        size_t ncap = pl->cap ? pl->cap * 2 : 64;
+        restore_item_t *n = realloc(pl->items, ncap * sizeof(restore_item_t));
+        if (!n) return -1;
+        pl->items = n; pl->cap = ncap;
+    }
+    char *dup = strdup(path);
+    if (!dup) return -1;
+    pl->items[pl->count++] = (restore_item_t){ dup, ino, isdir };
+    return 0;
+}
+
+static int restore_visit(tree_walk_t *w, uint16_t ino, void *arg) {
+    restore_plan_t *pl = arg;
+    if (ino > w->inode_count) return WALK_NEXT;
+    const char *nm = w->path + w->plen;
+    uint16_t fmt = inode_mode(w->inodes, ino) & 060000;
+    if (fmt == 020000 || fmt == 060000) return WALK_NEXT;
+    /* names that cannot be a single host path component, and paths the
+       host cannot open: report them and leave out the whole subtree */
+    const char *why = NULL;
+    if (w->nlen == 0 || memchr(nm, '/', w->nlen)) why = "not a valid host file name";
+    else if (strlen(pl->dest) + 1 + w->plen + w->nlen >= PATH_MAX) why = "path too long for the host";
+    if (why) {
+        fprintf(stderr, "Error: Skipping '%s/%s': %s\n", pl->dest, w->path, why);
+        pl->skipped = true;
+        return WALK_NEXT;
+    }
+    bool isdir = fmt == 040000;
+    if (restore_add(pl, w->path, ino, isdir) != 0) { pl->failed = true; return WALK_STOP; }
+    return isdir ? WALK_DESCEND : WALK_NEXT;
+}
+
+/* Write one planned file below rs->dest; returns 0 on success. */
+static int restore_file(restore_t *rs, const restore_item_t *it) {
+    char host[PATH_MAX];
+    if (snprintf(host, sizeof(host), "%s/%s", rs->dest, it->path) >= (int)sizeof(host)) return -1;
+    int fd = open(host, O_WRONLY | O_CREAT | O_TRUNC, (inode_mode(rs->inodes, it->ino) & 0777) | 0600);
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!f) {
+        fprintf(stderr, "Error: Unable to create '%s': %s\n", host, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int rc = extract_file_to_stdout(rs->disk, rs->inodes, rs->inode_count, it->ino, f,
+                                    0, rs->data_start, rs->data_end);
+    if (fclose(f) != 0) rc = -1;
+    return rc;
+}
+
+static void *restore_worker(void *arg) {
+    restore_t *rs = arg;
+    restore_plan_t *pl = rs->plan;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&rs->next, 1, __ATOMIC_RELAXED);
+        if (i >= pl->count) break;
+        if (pl->items[i].isdir) continue;
+        if (restore_file(rs, &pl->items[i]) != 0) __atomic_store_n(&rs->failed, true, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/* Extract inode ino (a directory's whole subtree, or a single file named
+   name) into the host directory dest, creating it if needed.
+   Returns 0 on success, -1 if anything could not be written. */
+static int restore_subtree(image_t *disk, inode_table_t *inodes, uint32_t inode_count, uint32_t ino,
+                           const char *name, const char *dest, uint32_t data_start, uint32_t data_end) {
+    if (mkdir(dest, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Unable to create '%s': %s\n", dest, strerror(errno));
+        return -1;
+    }
+    restore_plan_t plan = { .dest = dest };
+    restore_t rs = { disk, inodes, inode_count, data_start, data_end, dest, &plan, 0, false };
+    uint16_t fmt = inode_mode(inodes, ino) & 060000;
+    if (fmt == 040000) {
+        tree_walk_t w;
+        tree_walk_init(&w, disk, inodes, inode_count, data_start, data_end);
+        if (tree_walk(&w, ino, 0, restore_visit, &plan) != 0) plan.failed = true;
+        tree_walk_free(&w);
+    } else if (fmt != 020000 && fmt != 060000) {
+        if (restore_add(&plan, name, (uint16_t)ino, false) != 0) plan.failed = true;
+    }
+
+    /* directories first, in walk order so parents precede children */
+    char host[PATH_MAX];
+    for (size_t i = 0; i < plan.count && !plan.failed; i++) {
+        if (!plan.items[i].isdir) continue;
+        if (snprintf(host, sizeof(host), "%s/%s", dest, plan.items[i].path) >= (int)sizeof(host) ||
+            (mkdir(host, 0755) != 0 && errno != EEXIST)) {
+            fprintf(stderr, "Error: Unable to create '%s': %s\n", host, strerror(errno));
+            rs.failed = true;
+        }
+    }
+
+    /* the walk decoded every planned inode, so workers only read the table */
+    if (!plan.failed) {
+        pthread_t tids[MAX_WORKER_THREADS];
+        int nworkers = worker_threads(), started = 0;
+        while (started < nworkers - 1 &&
+               pthread_create(&tids[started], NULL, restore_worker, &rs) == 0) started++;
+        restore_worker(&rs);
+        for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    }
+    for (size_t i = 0; i < plan.count; i++) free(plan.items[i].path);
+    free(plan.items);
+    return (plan.failed || plan.skipped || rs.failed) ? -1 : 0;
+}
+
+/* Record a data-sector reference and report BAD-BLOCK if out of data area.
+ * (used by -c; keep for compatibility) */
+static void record_sector_for_check(uint32_t ino, uint16_t sector,
+                          uint32_t data_start, uint32_t data_end,
+                          uint32_t *sector_refcount, bool *any_errors, FILE *out) {
+	if (sector == 0) return;
+	if (sector < data_start || sector > data_end) {
+		fprintf(out, "BAD-BLOCK %u %u\n", (unsigned)ino, (unsigned)sector);
+		if (any_errors) *any_errors = true;
+		return;
+	}
+	if (sector_refcount) sector_refcount[sector]++;
+}
+
+/* A loaded image: backend, superblock fields, inode table and the
+   derived layout.  Everything a query needs, so it can be shared by many. */
+typedef struct {
+    image_t *disk;
+    uint16_t s_isize, s_fsize, s_nfree;
+    uint16_t s_free[100];
+    inode_table_t *inodes;
+    uint32_t inode_count;
+    uint32_t inode_start_sector, data_start, data_end;
+    bool persistent;           /* many queries follow: keep lookup tables */
+    dir_index_t *dindex;       /* built when persistent */
+    parent_map_t *pmap;        /* built on the first -p when persistent */
+    link_index_t *links;       /* built on the first -P when persistent */
+} fs_t;
+
+static void fs_close(fs_t *fs) {
+    if (!fs) return;
+    dir_index_free(fs->dindex);
+    parent_map_free(fs->pmap);
+    link_index_free(fs->links);
+    inode_table_free(fs->inodes);
+    image_close(fs->disk);
+    free(fs);
+}
+
+/* Open a disk image, read the superblock and set up the inode table.
+   Reports the problem on err (if not NULL) and returns NULL on error. */
+static fs_t *fs_load(const char *diskimage, FILE *err) {
+    fs_t *fs = calloc(1, sizeof(fs_t));
+    if (!fs) return NULL;
+    fs->disk = image_open(diskimage);
+    if (!fs->disk) {
+        if (err) fprintf(err, "Error: Unable to open disk image file '%s'\n", diskimage);
+        free(fs);
+        return NULL;
+    }
+
+    /* Read superblock (sector 1) */
+    unsigned char sbuf[512];
+    stat_kind(STAT_SUPER);
+    const unsigned char *sb = read_sector(fs->disk, 1, sbuf);
+    if (!sb) {
+        if (err) fprintf(err, "Error: Unable to read superblock from '%s'\n", diskimage);
+        fs_close(fs);
+        return NULL;
+    }
+    debug("directory scan kernel: %s", dirent_match_impl());
+    fs->s_isize = le16(&sb[0]);
+    fs->s_fsize = le16(&sb[2]);
+    fs->s_nfree = le16(&sb[4]);
+    for (int i = 0; i < 100; i++) fs->s_free[i] = le16(&sb[6 + i*2]);
+
+    /* Inode area layout */
+    uint32_t inode_sectors = fs->s_isize;
+    fs->inode_count = inode_sectors * INODES_PER_SECTOR;
+    fs->inode_start_sector = 2;
+    fs->data_start = fs->inode_start_sector + inode_sectors;
+    fs->data_end = (fs->s_fsize > 0) ? (fs->s_fsize - 1) : 0;
+
+    /* the inode area must lie within the image; inodes are decoded on use */
+    if (inode_sectors > 0 && !image_has_sector(fs->disk, fs->inode_start_sector + inode_sectors - 1)) {
+        fs_close(fs);
+        return NULL;
+    }
+    fs->inodes = inode_table_create(fs->disk, fs->inode_start_sector, fs->inode_count);
+    if (!fs->inodes) { fs_close(fs); return NULL; }
+    return fs;
+}
+
+static fs_t *fs_open(const char *diskimage) {
+    return fs_load(diskimage, stderr);
+}
+
+/* Parent map of the image, built on first use and kept.  Safe to call
+   from several threads; the first map published wins.  Returns NULL if
+   out of memory. */
+static parent_map_t *fs_parent_map(fs_t *fs) {
+    parent_map_t *pm = __atomic_load_n(&fs->pmap, __ATOMIC_ACQUIRE);
+    if (pm) return pm;
+    pm = parent_map_build(fs->disk, fs->inodes, fs->inode_count, fs->data_start, fs->data_end);
+    if (!pm) return NULL;
+    parent_map_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&fs->pmap, &expected, pm, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        parent_map_free(pm);
+        return expected;
+    }
+    return pm;
+}
+
+/* Count the directory entries in one directory block against refs[]. */
+static void count_dir_refs(const unsigned char *blk, uint32_t dirino, uint32_t *refs,
+                           inode_table_t *inodes, uint32_t inode_count,
+                           bool *any_errors, FILE *out) {
+    stat_add(entries, 32);
+    for (int e = 0; e < 32; e++) {
+        uint16_t ent_ino = le16(&blk[e*16]);
+        if (ent_ino == 0) continue;
+        if (ent_ino > inode_count || !(inode_mode(inodes, ent_ino) & 0100000)) {
+            fprintf(out, "BAD-ENTRY %u %u\n", (unsigned)dirino, (unsigned)ent_ino);
+            *any_errors = true;
+            continue;
+        }
+        refs[ent_ino]++;
+    }
+}
+
+/* One worker's share of the -c inode pass: inodes [first, last] are
+   scanned into private count arrays, and the BAD-BLOCK/BAD-ENTRY reports
+   are buffered so they can be emitted in inode order afterwards. */
+typedef struct {
+    fs_t *fs;
+    uint32_t first, last;
+    uint32_t *sector_refcount;  /* indexed by sector */
+    uint32_t *refs;             /* directory entries naming each inode */
+    char *report;
+    size_t report_len;
+    bool any_errors;
+    bool failed;
+} check_chunk_t;
+
+static void *check_inode_range(void *arg) {
+    check_chunk_t *ck = arg;
+    fs_t *fs = ck->fs;
+    image_t *disk = fs->disk;
+    inode_table_t *inodes = fs->inodes;
+    uint32_t inode_count = fs->inode_count;
+    uint32_t data_start = fs->data_start, data_end = fs->data_end;
+    const uint16_t IFMT = 060000;
+    const uint16_t IFDIR = 040000;
+    const uint16_t IFCHR = 020000;
+    const uint16_t IFBLK = 060000;
+
+    FILE *out = open_memstream(&ck->report, &ck->report_len);
+    if (!out) { ck->failed = true; return NULL; }
+    uint32_t *sector_refcount = ck->sector_refcount;
+    uint32_t *refs = ck->refs;
+    /* the table is fully decoded: sweep the mode and address columns */
+    const uint16_t *modes = inodes->modes;
+    const uint16_t (*addrs)[8] = (const uint16_t (*)[8])inodes->addrs;
+    unsigned char secbuf[512], indirbuf[512];
+    for (uint32_t ino = ck->first; ino <= ck->last; ino++) {
+        uint16_t mode = modes[ino];
+        if (!(mode & 0100000)) continue;
+        uint16_t fmt = mode & IFMT;
+        if (fmt == IFCHR || fmt == IFBLK) continue; // i_addr holds a device number
+        bool isdir = (fmt == IFDIR);
+        bool is_large = (mode & 010000) != 0;
+        for (int k = 0; k < 8; k++) {
+            uint16_t addr = addrs[ino][k];
+            record_sector_for_check(ino, addr, data_start, data_end, sector_refcount, &ck->any_errors, out);
+            if (addr < data_start || addr > data_end) continue;
+            if (!is_large) {
+                if (!isdir) continue;
+                stat_kind(STAT_DIR);
+                const unsigned char *blk = read_sector(disk, addr, secbuf);
+                if (blk) count_dir_refs(blk, ino, refs, inodes, inode_count, &ck->any_errors, out);
+                continue;
+            }
+            stat_kind(STAT_INDIRECT);
+            const unsigned char *iblk = read_sector(disk, addr, indirbuf);
+            if (!iblk) continue;
+            for (int e = 0; e < 256; e++) {
+                uint16_t sec = le16(&iblk[e*2]);
+                record_sector_for_check(ino, sec, data_start, data_end, sector_refcount, &ck->any_errors, out);
+                if (!isdir || sec < data_start || sec > data_end) continue;
+                stat_kind(STAT_DIR);
+                const unsigned char *blk = read_sector(disk, sec, secbuf);
+                if (blk) count_dir_refs(blk, ino, refs, inodes, inode_count, &ck->any_errors, out);
+            }
+        }
+    }
+    fclose(out);
+    return NULL;
+}
+
+/* tree_walk() visitor for the -c connectivity pass: mark every allocated
+   inode named from an allocated directory reachable from the root. */
+static int check_visit(tree_walk_t *w, uint16_t ino, void *arg) {
+    uint8_t *reached = arg;
+    if (ino > w->inode_count || !(inode_mode(w->inodes, ino) & 0100000)) return WALK_NEXT;
+    reached[ino] = 1;
+    return WALK_DESCEND;
+}
+
+/* Filesystem consistency check (-c).  A single pass over the inode table
+   records every block reference in a per-sector count (BAD-BLOCK for
+   references outside the data area) and, for directories, tallies the
+   entries that point at each inode.  The pass is split into inode ranges
+   checked by worker threads with private arrays, merged afterwards in
+   inode order.  The counts are then compared against the
+   free list (s_nfree/s_free and its chain) and the i_nlink fields, and a
+   tree_walk() from the root finds allocated inodes no path leads to.
+   Reports, one per line:
+       BAD-BLOCK <ino> <sector>     block address outside the data area
+       BAD-ENTRY <dirino> <ino>     entry names an unallocated/invalid inode
+       DUP-BLOCK <sector> <refs>    block claimed more than once
+       BAD-FREE <sector>            free-list entry outside the data area
+       DUP-FREE <sector>            block on the free list more than once
+       FREE-INUSE <sector>          block both free and in use
+       MISSING-BLOCK <sector>       block neither free nor in use
+       LINK-COUNT <ino> <nlink> <refs>
+       UNREACHABLE <ino>            allocated but not reachable from /
+   Returns EXIT_FAILURE if anything was reported. */
+static int check_filesystem(fs_t *fs, FILE *out) {
+    image_t *disk = fs->disk;
+    inode_table_t *inodes = fs->inodes;
+    uint32_t inode_count = fs->inode_count;
+    uint32_t data_start = fs->data_start, data_end = fs->data_end;
+    bool any_errors = false;
+    uint32_t nsectors = data_end + 1;
+
+    inode_table_load_all(inodes);
+    int nthreads = worker_threads();
+    if ((uint32_t)nthreads > inode_count / CHECK_MIN_CHUNK) nthreads = (int)(inode_count / CHECK_MIN_CHUNK);
+    if (nthreads < 1) nthreads = 1;
+
+    check_chunk_t chunks[MAX_WORKER_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    bool ok = true;
+    uint32_t per = (inode_count + nthreads - 1) / nthreads;
+    for (int t = 0; t < nthreads; t++) {
+        chunks[t].fs = fs;
+        chunks[t].first = 1 + t * per;
+        chunks[t].last = (t + 1) * per < inode_count ? (t + 1) * per : inode_count;
+        chunks[t].sector_refcount = calloc(nsectors, sizeof(uint32_t));
+        chunks[t].refs = calloc(inode_count + 1, sizeof(uint32_t));
+        if (!chunks[t].sector_refcount || !chunks[t].refs) ok = false;
+    }
+    pthread_t tids[MAX_WORKER_THREADS];
+    int started = 0;
+    if (ok) {
+        for (started = 1; started < nthreads; started++)
+            if (pthread_create(&tids[started], NULL, check_inode_range, &chunks[started]) != 0) break;
+        for (int t = started; t < nthreads; t++) check_inode_range(&chunks[t]);
+        check_inode_range(&chunks[0]);
+        for (int t = 1; t < started; t++) pthread_join(tids[t], NULL);
+    }
+
+    /* merge into chunk 0 and emit the per-inode reports in inode order */
+    uint32_t *sector_refcount = chunks[0].sector_refcount;
+    uint32_t *refs = chunks[0].refs;
+    for (int t = 0; t < nthreads; t++) {
+        ok = ok && !chunks[t].failed;
+        any_errors = any_errors || chunks[t].any_errors;
+        if (ok && chunks[t].report_len) fwrite(chunks[t].report, 1, chunks[t].report_len, out);
+        if (ok && t > 0) {
+            for (uint32_t sec = 0; sec < nsectors; sec++) sector_refcount[sec] += chunks[t].sector_refcount[sec];
+            for (uint32_t ino = 0; ino <= inode_count; ino++) refs[ino] += chunks[t].refs[ino];
+        }
+        free(chunks[t].report);
+        if (t > 0) { free(chunks[t].sector_refcount); free(chunks[t].refs); }
+    }
+    unsigned char *on_free = ok ? calloc(nsectors, 1) : NULL;
+    if (!on_free) {
+        free(sector_refcount); free(refs);
+        return EXIT_FAILURE;
+    }
+    unsigned char secbuf[512];
+
+    for (uint32_t sec = data_start; sec < nsectors; sec++) {
+        if (sector_refcount[sec] > 1) {
+            fprintf(out, "DUP-BLOCK %u %u\n", (unsigned)sec, (unsigned)sector_refcount[sec]);
+            any_errors = true;
+        }
+    }
+
+    /* Walk the free list: the superblock holds the first s_nfree entries;
+       entry 0, if non-zero, is a free block holding the next count and list. */
+    uint16_t nfree = fs->s_nfree;
+    uint16_t list[100];
+    memcpy(list, fs->s_free, sizeof(list));
+    for (;;) {
+        if (nfree > 100) {
+            fprintf(out, "BAD-FREE %u\n", (unsigned)nfree);
+            any_errors = true;
+            break;
+        }
+        for (uint16_t i = 0; i < nfree; i++) {
+            uint16_t sec = list[i];
+            if (sec == 0) continue;
+            if (sec < data_start || sec > data_end) {
+                fprintf(out, "BAD-FREE %u\n", (unsigned)sec);
+                any_errors = true;
+                continue;
+            }
+            if (on_free[sec]) {
+                fprintf(out, "DUP-FREE %u\n", (unsigned)sec);
+                any_errors = true;
+                list[i] = 0; // never follow a chain link twice
+                continue;
+            }
+            on_free[sec] = 1;
+            if (sector_refcount[sec]) {
+                fprintf(out, "FREE-INUSE %u\n", (unsigned)sec);
+                any_errors = true;
+            }
+        }
+        uint16_t next = nfree ? list[0] : 0;
+        if (next < data_start || next > data_end) break;
+        stat_kind(STAT_FREELIST);
+        const unsigned char *blk = read_sector(disk, next, secbuf);
+        if (!blk) break;
+        nfree = le16(&blk[0]);
+        for (int i = 0; i < 100; i++) list[i] = le16(&blk[2 + i*2]);
+    }
+
+    for (uint32_t sec = data_start; sec < nsectors; sec++) {
+        if (!sector_refcount[sec] && !on_free[sec]) {
+            fprintf(out, "MISSING-BLOCK %u\n", (unsigned)sec);
+            any_errors = true;
+        }
+    }
+
+    for (uint32_t ino = 1; ino <= inode_count; ino++) {
+        if (!(inodes->modes[ino] & 0100000)) continue;
+        if (inode_at(inodes, ino)->i_nlink != refs[ino]) {
+            fprintf(out, "LINK-COUNT %u %u %u\n", (unsigned)ino,
+                    (unsigned)inode_at(inodes, ino)->i_nlink, (unsigned)refs[ino]);
+            any_errors = true;
+        }
+    }
+
+    uint8_t *reached = calloc(inode_count + 1, 1);
+    tree_walk_t w;
+    tree_walk_init(&w, disk, fs->inodes, inode_count, data_start, data_end);
+    if (!reached || tree_walk(&w, 1, 0, check_visit, reached) != 0) {
+        tree_walk_free(&w);
+        free(reached); free(sector_refcount); free(refs); free(on_free);
+        return EXIT_FAILURE;
+    }
+    tree_walk_free(&w);
+    if (inode_count >= 1) reached[1] = 1;
+    for (uint32_t ino = 1; ino <= inode_count; ino++) {
+        if (!(inodes->modes[ino] & 0100000) || reached[ino]) continue;
+        fprintf(out, "UNREACHABLE %u\n", (unsigned)ino);
+        any_errors = true;
+    }
+    free(reached);
+
+    free(sector_refcount);
+    free(refs);
+    free(on_free);
+    return any_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* I-number named by the argument of -x (a number with -i, a path with -n),
+   or 0 if there is none or it is a directory. */
+static uint32_t extract_target(fs_t *fs, bool by_inode, const char *arg) {
+    if (!arg) return 0;
+    uint32_t ino = 0;
+    if (by_inode) {
+        char *endptr = NULL;
+        long inum = strtol(arg, &endptr, 10);
+        if (*arg == '\0' || *endptr != '\0' || inum <= 0) return 0;
+        if ((unsigned long)inum > fs->inode_count) return 0;
+        ino = (uint32_t)inum;
+    } else {
+        ino = resolve_pathname(fs->disk, fs->inodes, fs->inode_count, fs->dindex, arg,
+                               fs->inode_start_sector, fs->data_start, fs->data_end);
+        if (ino == 0) return 0;
+    }
+    // verify regular file
+    uint16_t IFMT = 060000;
+    if ((inode_mode(fs->inodes, ino) & IFMT) == 040000) return 0; // directory
+    return ino;
+}
+
+/* Run a single query against a loaded image, writing to out exactly what the
+   corresponding command line prints on stdout.  mode is the option letter
+   (x, r, p, P, l, a, c), by_inode selects -i over -n.  Returns an exit status. */
+static int run_query(fs_t *fs, char mode, bool by_inode, const char *arg, FILE *out) {
+    image_t *disk = fs->disk;
+    inode_table_t *inodes = fs->inodes;
+    uint32_t inode_count = fs->inode_count;
+    uint32_t inode_start_sector = fs->inode_start_sector;
+    uint32_t data_start = fs->data_start, data_end = fs->data_end;
+
+    if (fs->persistent && !fs->dindex) fs->dindex = dir_index_new(inode_count);
+
+    /* Handle modes that were implemented: -r (resolve), -p (print pathname),
+       -l -n (list names), -x -n (extract by name) or -x -i (extract by inode) */
+    if (mode == 'r') {
+        uint32_t ino = resolve_pathname(disk, inodes, inode_count, fs->dindex, arg,
+                                        inode_start_sector, data_start, data_end);
+        if (ino == 0) return EXIT_FAILURE;
+        fprintf(out, "%u\n", (unsigned)ino);
+        return EXIT_SUCCESS;
+    }
+
+    if (mode == 'p') {
+        if (!arg) return EXIT_FAILURE;
+        char *endptr = NULL;
+        long inum = strtol(arg, &endptr, 10);
+        if (*arg == '\0' || *endptr != '\0') return EXIT_FAILURE;
+        if (inum < 1 || (uint32_t)inum > inode_count) return EXIT_FAILURE;
+        // verify inode is allocated and a directory
+        if (!(inode_mode(inodes, inum) & 0100000)) return EXIT_FAILURE;
+        if ((inode_mode(inodes, inum) & 060000) != 040000) return EXIT_FAILURE;
+        parent_map_t *pm = fs->persistent ? fs_parent_map(fs) : NULL;
+        char *canon = NULL;
+        bool fallback = true;
+        if (pm) canon = canonical_path_mapped(pm, inodes, (uint32_t)inum, &fallback);
+        if (fallback)
+            canon = canonical_path(disk, inodes, inode_count, (uint32_t)inum,
+                                   inode_start_sector, data_start, data_end);
+        if (!canon) return EXIT_FAILURE;
+        fprintf(out, "%s\n", canon);
+        free(canon);
+        return EXIT_SUCCESS;
+    }
+
+    if (mode == 'P') {
+        long inum = 0;
+        if (arg) {
+            char *endptr = NULL;
+            inum = strtol(arg, &endptr, 10);
+            if (*arg == '\0' || *endptr != '\0') return EXIT_FAILURE;
+            if (inum < 1 || (uint32_t)inum > inode_count) return EXIT_FAILURE;
+        }
+        link_index_t *li = fs->links;
+        if (!li) li = link_index_build(disk, inodes, inode_count, data_start, data_end);
+        if (!li) return EXIT_FAILURE;
+        int status = EXIT_SUCCESS;
+        link_chain_t ch = { 0 };
+        if (arg) {
+            if (link_print_paths(li, inodes, (uint32_t)inum, false, &ch, out) == 0) status = EXIT_FAILURE;
+        } else {
+            for (uint32_t ino = 1; ino <= inode_count && !ch.failed; ino++)
+                link_print_paths(li, inodes, ino, true, &ch, out);
+        }
+        if (ch.failed) status = EXIT_FAILURE;
+        free(ch.ids);
+        if (fs->persistent) fs->links = li;
+        else link_index_free(li);
+        return status;
+    }
+
+    if (mode == 'l' && !by_inode) {
+        if (!arg) return EXIT_FAILURE;
+        uint32_t dirino = resolve_pathname(disk, inodes, inode_count, fs->dindex, arg,
+                                           inode_start_sector, data_start, data_end);
+        if (dirino == 0) return EXIT_FAILURE;
+        // list recursively with empty prefix for top-level
+        if (list_tree(disk, inodes, inode_count, dirino, out, inode_start_sector, data_start, data_end) != 0)
+            return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+    }
+
+    if (mode == 'x') {
+        uint32_t ino = extract_target(fs, by_inode, arg);
+        if (ino == 0) return EXIT_FAILURE;
+        if (extract_file_to_stdout(disk, inodes, inode_count, ino, out, inode_start_sector, data_start, data_end) != 0)
+            return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+    }
+
+    if (mode == 'a') {
+        if (archive_hierarchy(disk, inodes, inode_count, out, data_start, data_end) != 0)
+            return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+    }
+
+    if (mode == 'c') {
+        return check_filesystem(fs, out);
+    }
+
+    // default
+    return EXIT_SUCCESS;
+}
+
+/* -x with --offset/--length: write bytes [off, off+len) of the file to
+   out, clamped to its size.  Offsets are file offsets, so holes read as
+   zeros here, unlike plain -x, which leaves them out.  len UINT64_MAX is
+   "to the end". */
+static int run_extract_range(fs_t *fs, bool by_inode, const char *arg, uint64_t off, uint64_t len,
+                             FILE *out) {
+    uint32_t ino = extract_target(fs, by_inode, arg);
+    if (ino == 0) return EXIT_FAILURE;
+    uint16_t fmt = inode_mode(fs->inodes, ino) & 060000;
+    if (fmt == 020000 || fmt == 060000) return EXIT_FAILURE; // device
+    unsigned char buf[EXTRACT_RANGE_CHUNK];
+    idisk_t *in = inode_at(fs->inodes, ino);
+    /* a short read stops before a bad block, and the next one fails on it */
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? (size_t)len : sizeof(buf);
+        ssize_t n = inode_pread(fs->disk, in, buf, want, off, fs->data_start, fs->data_end);
+        if (n < 0) return EXIT_FAILURE;
+        if (n == 0) break;
+        stat_phase_enter(STAT_PH_OUTPUT);
+        size_t w = fwrite(buf, 1, (size_t)n, out);
+        stat_phase_leave();
+        if (w != (size_t)n) return EXIT_FAILURE;
+        off += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* -X: extract the file or subtree at path into the host directory dest. */
+static int run_restore(fs_t *fs, const char *path, const char *dest) {
+    uint32_t ino = resolve_pathname(fs->disk, fs->inodes, fs->inode_count, fs->dindex, path,
+                                    fs->inode_start_sector, fs->data_start, fs->data_end);
+    if (ino == 0) return EXIT_FAILURE;
+    /* a file is written under its last path component */
+    char name[15] = "";
+    size_t end = strlen(path);
+    while (end > 1 && path[end-1] == '/') end--;
+    size_t start = end;
+    while (start > 0 && path[start-1] != '/') start--;
+    snprintf(name, sizeof(name), "%.*s", (int)(end - start), path + start);
+    if (restore_subtree(fs->disk, fs->inodes, fs->inode_count, ino, name, dest,
+                        fs->data_start, fs->data_end) != 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+/* Parse and run one query line (see run_batch for the syntax), capturing
+   its output in a malloc'd buffer.  Returns the exit status, or -1 if the
+   output could not be captured. */
+static int run_query_line(fs_t *fs, char *line, char **outbuf, size_t *outlen) {
+    char *arg = strchr(line, ' ');
+    if (arg) *arg++ = '\0';
+    char mode = 0;
+    bool by_inode = false;
+    if (strcmp(line, "r") == 0 || strcmp(line, "p") == 0 ||
+        strcmp(line, "P") == 0 || strcmp(line, "l") == 0 ||
+        strcmp(line, "x") == 0) mode = line[0];
+    else if (strcmp(line, "xi") == 0) { mode = 'x'; by_inode = true; }
+
+    *outbuf = NULL;
+    FILE *mem = open_memstream(outbuf, outlen);
+    if (!mem) return -1;
+    int status = EXIT_FAILURE;
+    if (mode && arg) status = run_query(fs, mode, by_inode, arg, mem);
+    else fprintf(stderr, "Error: Bad query: %s\n", line);
+    fclose(mem);
+    return status;
+}
+
+/* Batch mode: read one query per line from in and answer each against the
+   already loaded image.  Queries are
+       r PATH    resolve pathname          (-r PATH)
+       p INUM    reverse-map i-number      (-p INUM)
+       P INUM    all pathnames of i-number (-P INUM)
+       l PATH    list hierarchy            (-l PATH -n)
+       x PATH    extract by name           (-x PATH -n)
+       xi INUM   extract by i-number       (-x INUM -i)
+   Every answer is a header line "<exit status> <length>" followed by exactly
+   <length> bytes of what the single command would print on stdout. */
+static int run_batch(fs_t *fs, FILE *in, FILE *out) {
+    fs->persistent = true;
+
+    char *line = NULL, *buf = NULL;
+    size_t linecap = 0, buflen = 0;
+    ssize_t n;
+    while ((n = getline(&line, &linecap, in)) != -1) {
+        while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) line[--n] = '\0';
+        if (n == 0) continue;
+
+        int status = run_query_line(fs, line, &buf, &buflen);
+        if (status < 0) { free(line); return EXIT_FAILURE; }
+        fprintf(out, "%d %zu\n", status, buflen);
+        fwrite(buf, 1, buflen, out);
+        free(buf); buf = NULL;
+    }
+    free(line);
+    return ferror(out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_on_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
 }
 
-/* inode on-disk representation (subset used) */
+/* A client connection of the daemon.  Sockets are non-blocking and all
+   I/O is driven by the poll loop, so a client that stalls halfway through
+   a request or stops reading its answer only holds up itself; it is
+   dropped once it has made no progress for SERVE_TIMEOUT_MS. */
 typedef struct {
-    uint16_t i_mode;
-    uint8_t  i_nlink;
-    uint8_t  i_uid;
-    uint8_t  i_gid;
-    uint8_t  i_size0;
-    uint16_t i_size1;
-    uint16_t i_addr[8];
-} idisk_t;
+    int fd;
+    unsigned char in[4 + DOSIERO_MAX_REQUEST];  /* length prefix, then the query */
+    size_t inlen;
+    unsigned char *out;        /* framed answer being sent, NULL if none */
+    size_t outlen, outoff;
+    int64_t since;             /* ms of the last progress on a pending request/answer */
+} conn_t;
 
-/* Helper to build a 24-bit size from i_size0/i_size1 */
-static uint32_t inode_size_bytes(const idisk_t *ino) {
-    return ((uint32_t)ino->i_size0 << 16) | (uint32_t)(ino->i_size1 & 0xFFFF);
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-/* helper to check a data sector for name */
-static uint16_t check_sector(FILE *disk, uint16_t sec, unsigned char *secbuf, idisk_t *inodes, uint32_t inode_count, const char *name, uint32_t data_start, uint32_t data_end) {
-    if (sec == 0) return 0;
-    if (sec < data_start || sec > data_end) return 0;
-    if (read_sector(disk, sec, secbuf) != 0) return 0;
-    for (int e = 0; e < 32; e++) {
-        unsigned char *ent = &secbuf[e*16];
-        uint16_t ent_ino = le16(ent);
-        if (ent_ino == 0) continue;
-        char nm[15]; memset(nm,0,sizeof(nm));
-        memcpy(nm, &ent[2], 14);
-        if (strncmp(nm, name, 14) == 0) return ent_ino;
+static bool conn_busy(const conn_t *c) {
+    return c->inlen > 0 || c->out;
+}
+
+/* Send what the socket takes of the pending answer.  Returns -1 when the
+   connection should be dropped. */
+static int conn_write(conn_t *c, int64_t now) {
+    while (c->outoff < c->outlen) {
+        ssize_t n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        c->outoff += (size_t)n;
+        c->since = now;
     }
+    free(c->out);
+    c->out = NULL;
     return 0;
 }
 
-/* Search directory 'dirino' for entry with given name; returns inode number or 0 if not found.
-   Uses inodes[], disk, and computed data_start/data_end. */
-static uint16_t find_in_dir(FILE *disk, idisk_t *inodes, uint32_t inode_count,
-                            uint32_t dirino, const char *name,
-                            uint32_t inode_start_sector, uint32_t data_start, uint32_t data_end) {
-    if (dirino < 1 || dirino > inode_count) return 0;
-    idisk_t *din = &inodes[dirino];
-    const uint16_t IFMT = 060000;
-    const uint16_t IFDIR = 040000;
-    if ((din->i_mode & IFMT) != IFDIR) return 0;
-
-    unsigned char secbuf[512];
-    bool is_large = (din->i_mode & 010000) != 0;
+/* Answer the complete request in c->in. */
+static int conn_answer(fs_t *fs, conn_t *c, uint32_t len, int64_t now) {
+    char *line = (char *)c->in + 4;
+    line[len] = '\0';
+    char *buf = NULL;
+    size_t buflen = 0;
+    int status = run_query_line(fs, line, &buf, &buflen);
+    c->inlen = 0;
+    if (status < 0) return -1;
+    c->out = malloc(8 + buflen);
+    if (!c->out) { free(buf); return -1; }
+    uint32_t hdr[2] = { htonl((uint32_t)status), htonl((uint32_t)buflen) };
+    memcpy(c->out, hdr, 8);
+    memcpy(c->out + 8, buf, buflen);
+    free(buf);
+    c->outlen = 8 + buflen;
+    c->outoff = 0;
+    c->since = now;
+    return conn_write(c, now);
+}
 
-    if (!is_large) {
-        for (int k = 0; k < 8; k++) {
-            uint16_t sec = din->i_addr[k];
-            uint16_t found = check_sector(disk, sec, secbuf, inodes, inode_count, name, data_start, data_end);
-            if (found) return found;
-        }
-    } else {
-        /* indirect blocks */
-        unsigned char indirbuf[512];
-        for (int k = 0; k < 8; k++) {
-            uint16_t indir = din->i_addr[k];
-            if (indir == 0) continue;
-            if (indir < data_start || indir > data_end) continue;
-            if (read_sector(disk, indir, indirbuf) != 0) continue;
-            for (int e = 0; e < 256; e++) {
-                uint16_t sec = le16(&indirbuf[e*2]);
-                uint16_t found = check_sector(disk, sec, secbuf, inodes, inode_count, name, data_start, data_end);
-                if (found) return found;
-            }
+/* Read what has arrived of the next request, answering it once complete.
+   Returns -1 when the connection should be dropped. */
+static int conn_read(fs_t *fs, conn_t *c, int64_t now) {
+    for (;;) {
+        size_t want = 4;
+        uint32_t len = 0;
+        if (c->inlen >= 4) {
+            memcpy(&len, c->in, 4);
+            len = ntohl(len);
+            if (len == 0 || len > DOSIERO_MAX_REQUEST) return -1;
+            want = 4 + len;
         }
+        if (c->inlen == want) return conn_answer(fs, c, len, now);
+        ssize_t n = read(c->fd, c->in + c->inlen, want - c->inlen);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        c->inlen += (size_t)n;
+        c->since = now;
     }
-    return 0;
 }
 
-/* Resolve an absolute pathname to i-number. Returns 0 on not found / error. */
-static uint32_t resolve_pathname(FILE *disk, idisk_t *inodes, uint32_t inode_count,
-                                 const char *path,
-                                 uint32_t inode_start_sector, uint32_t data_start, uint32_t data_end) {
-    if (!path || path[0] != '/') return 0;
-    if (strcmp(path, "/") == 0) return 1;
-    // split path into components
-    char tmp[4096];
-    strncpy(tmp, path, sizeof(tmp)-1);
-    tmp[sizeof(tmp)-1] = 0;
-    char *save = NULL;
-    char *comp = strtok_r(tmp, "/", &save);
-    uint32_t cur = 1; // start at root
-    while (comp) {
-        uint16_t next = find_in_dir(disk, inodes, inode_count, cur, comp, inode_start_sector, data_start, data_end);
-        if (next == 0) return 0;
-        cur = next;
-        comp = strtok_r(NULL, "/", &save);
+/* Daemon mode: keep the image loaded and answer framed queries (see
+   dosiero.h for the wire format) from any number of local clients on a
+   Unix domain socket until SIGINT/SIGTERM.  Queries are answered one at
+   a time; only the socket I/O is interleaved. */
+static int run_server(fs_t *fs, const char *sockpath) {
+
+    fs->persistent = true;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: '%s'\n", sockpath);
+        return EXIT_FAILURE;
     }
-    return cur;
-}
+    strcpy(addr.sun_path, sockpath);
 
-/* Compute canonical absolute pathname of a directory inode (assumes inode is a directory).
-   Returns a malloc'd string (caller must free) or NULL on error. */
-static char *canonical_path(FILE *disk, idisk_t *inodes, uint32_t inode_count,
-                            uint32_t target_inode,
-                            uint32_t inode_start_sector, uint32_t data_start, uint32_t data_end) {
-    if (target_inode < 1 || target_inode > inode_count) return NULL;
-    if (target_inode == 1) {
-        char *r = malloc(3); if (!r) return NULL; strcpy(r, "/"); strcat(r, "/"); return r; // return "/"
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) { perror("socket"); return EXIT_FAILURE; }
+    struct stat st;
+    if (stat(sockpath, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(sockpath);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 64) != 0) {
+        fprintf(stderr, "Error: Unable to listen on '%s': %s\n", sockpath, strerror(errno));
+        close(lfd);
+        return EXIT_FAILURE;
     }
-    // store components in reverse
-    char **components = malloc((inode_count+2) * sizeof(char*));
-    if (!components) return NULL;
-    int compc = 0;
-    uint32_t cur = target_inode;
-    unsigned char secbuf[512];
 
-    while (cur != 1) {
-        // read '..' from current directory
-        uint16_t parent = 0;
-        idisk_t *din = &inodes[cur];
-        bool is_large = (din->i_mode & 010000) != 0;
-        bool found_dotdot = false;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-        if (!is_large) {
-            for (int k = 0; k < 8 && !found_dotdot; k++) {
-                uint16_t sec = din->i_addr[k];
-                if (sec == 0) continue;
-                if (sec < data_start || sec > data_end) continue;
-                if (read_sector(disk, sec, secbuf) != 0) continue;
-                for (int e = 0; e < 32; e++) {
-                    unsigned char *ent = &secbuf[e*16];
-                    uint16_t ent_ino = le16(ent);
-                    if (ent_ino == 0) continue;
-                    char nm[15]; memset(nm,0,sizeof(nm)); memcpy(nm, &ent[2], 14);
-                    if (strcmp(nm, "..") == 0) { parent = ent_ino; found_dotdot = true; break; }
-                }
-            }
-        } else {
-            unsigned char indirbuf[512];
-            for (int k = 0; k < 8 && !found_dotdot; k++) {
-                uint16_t indir = din->i_addr[k];
-                if (indir == 0) continue;
-                if (indir < data_start || indir > data_end) continue;
-                if (read_sector(disk, indir, indirbuf) != 0) continue;
-                for (int e = 0; e < 256 && !found_dotdot; e++) {
-                    uint16_t sec = le16(&indirbuf[e*2]);
-                    if (sec == 0) continue;
-                    if (sec < data_start || sec > data_end) continue;
-                    if (read_sector(disk, sec, secbuf) != 0) continue;
-                    for (int ee = 0; ee < 32; ee++) {
-                        unsigned char *ent = &secbuf[ee*16];
-                        uint16_t ent_ino = le16(ent);
-                        if (ent_ino == 0) continue;
-                        char nm[15]; memset(nm,0,sizeof(nm)); memcpy(nm, &ent[2], 14);
-                        if (strcmp(nm, "..") == 0) { parent = ent_ino; found_dotdot = true; break; }
-                    }
-                }
-            }
+    size_t nconns = 0, cap = 16;
+    conn_t **conns = malloc(cap * sizeof(conn_t *));
+    struct pollfd *pfds = malloc((cap + 1) * sizeof(struct pollfd));
+    if (!conns || !pfds) { free(conns); free(pfds); close(lfd); unlink(sockpath); return EXIT_FAILURE; }
+
+    while (!serve_stop) {
+        int64_t now = monotonic_ms();
+        int timeout = -1;
+        pfds[0].fd = lfd;
+        pfds[0].events = POLLIN;
+        for (size_t i = 0; i < nconns; i++) {
+            conn_t *c = conns[i];
+            pfds[i + 1].fd = c->fd;
+            pfds[i + 1].events = c->out ? POLLOUT : POLLIN;
+            if (!conn_busy(c)) continue;
+            int64_t left = c->since + SERVE_TIMEOUT_MS - now;
+            if (left < 0) left = 0;
+            if (timeout < 0 || left < timeout) timeout = (int)left;
         }
-        if (!found_dotdot || parent == 0) { // malformed
-            for (int i = 0; i < compc; i++) free(components[i]);
-            free(components);
-            return NULL;
+        if (poll(pfds, nconns + 1, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
         }
-        // find in parent the entry that references cur (not '.' or '..')
-        idisk_t *pin = &inodes[parent];
-        bool found_name = false;
-        char foundnm[15]; memset(foundnm,0,sizeof(foundnm));
-        bool p_large = (pin->i_mode & 010000) != 0;
-        if (!p_large) {
-            for (int k = 0; k < 8 && !found_name; k++) {
-                uint16_t sec = pin->i_addr[k];
-                if (sec == 0) continue;
-                if (sec < data_start || sec > data_end) continue;
-                if (read_sector(disk, sec, secbuf) != 0) continue;
-                for (int e = 0; e < 32; e++) {
-                    unsigned char *ent = &secbuf[e*16];
-                    uint16_t ent_ino = le16(ent);
-                    if (ent_ino != cur) continue;
-                    char nm[15]; memset(nm,0,sizeof(nm)); memcpy(nm, &ent[2], 14);
-                    if (strcmp(nm, ".") == 0 || strcmp(nm, "..") == 0) continue;
-                    strncpy(foundnm, nm, 14);
-                    found_name = true; break;
-                }
+        now = monotonic_ms();
+        for (size_t i = nconns; i-- > 0; ) {
+            conn_t *c = conns[i];
+            short rev = pfds[i + 1].revents;
+            int rc = 0;
+            if (c->out && (rev & (POLLOUT | POLLERR | POLLHUP))) rc = conn_write(c, now);
+            else if (!c->out && (rev & (POLLIN | POLLERR | POLLHUP))) rc = conn_read(fs, c, now);
+            if (rc == 0 && (!conn_busy(c) || now - c->since < SERVE_TIMEOUT_MS)) continue;
+            close(c->fd);
+            free(c->out);
+            free(c);
+            conns[i] = conns[--nconns];
+        }
+        if (pfds[0].revents & POLLIN) {
+            int cfd = accept(lfd, NULL, NULL);
+            if (cfd < 0) continue;
+            if (nconns == cap) {
+                conn_t **nc = realloc(conns, cap * 2 * sizeof(conn_t *));
+                if (nc) conns = nc;
+                struct pollfd *np = nc ? realloc(pfds, (cap * 2 + 1) * sizeof(struct pollfd)) : NULL;
+                if (!np) { close(cfd); continue; }
+                pfds = np; cap *= 2;
             }
-        } else {
-            unsigned char indirbuf[512];
-            for (int k = 0; k < 8 && !found_name; k++) {
-                uint16_t indir = pin->i_addr[k];
-                if (indir == 0) continue;
-                if (indir < data_start || indir > data_end) continue;
-                if (read_sector(disk, indir, indirbuf) != 0) continue;
-                for (int e = 0; e < 256 && !found_name; e++) {
-                    uint16_t sec = le16(&indirbuf[e*2]);
-                    if (sec == 0) continue;
-                    if (sec < data_start || sec > data_end) continue;
-                    if (read_sector(disk, sec, secbuf) != 0) continue;
-                    for (int ee = 0; ee < 32; ee++) {
-                        unsigned char *ent = &secbuf[ee*16];
-                        uint16_t ent_ino = le16(ent);
-                        if (ent_ino != cur) continue;
-                        char nm[15]; memset(nm,0,sizeof(nm)); memcpy(nm, &ent[2], 14);
-                        if (strcmp(nm, ".") == 0 || strcmp(nm, "..") == 0) continue;
-                        strncpy(foundnm, nm, 14);
-                        found_name = true; break;
-                    }
-                }
+            conn_t *c = calloc(1, sizeof(conn_t));
+            if (!c || fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK) != 0) {
+                free(c);
+                close(cfd);
+                continue;
             }
+            c->fd = cfd;
+            conns[nconns++] = c;
         }
-        if (!found_name) {
-            // could be root link or missing; treat as error
-            for (int i = 0; i < compc; i++) free(components[i]);
-            free(components);
-            return NULL;
-        }
-        // push component
-        components[compc++] = strdup(foundnm);
-        cur = parent;
     }
 
-    // assemble path; allocate enough space for trailing '/'
-    size_t total = 1; // leading '/'
-    for (int i = compc-1; i >= 0; i--) total += strlen(components[i]) + 1;
-    total += 1; // extra for trailing '/'
-    char *out = malloc(total + 1);
-    if (!out) {
-        for (int i = 0; i < compc; i++) free(components[i]);
-        free(components); return NULL;
-    }
-    out[0] = '/'; out[1] = 0;
-    for (int i = compc-1; i >= 0; i--) {
-        if (strlen(out) > 1) strcat(out, "/");
-        strcat(out, components[i]);
-    }
-    // ensure trailing '/'
-    size_t len = strlen(out);
-    if (len == 0 || out[len-1] != '/') {
-        strcat(out, "/");
+    for (size_t i = 0; i < nconns; i++) {
+        close(conns[i]->fd);
+        free(conns[i]->out);
+        free(conns[i]);
     }
-    // cleanup
-    for (int i = 0; i < compc; i++) free(components[i]);
-    free(components);
-    return out;
+    free(conns);
+    free(pfds);
+    close(lfd);
+    unlink(sockpath);
+    return EXIT_SUCCESS;
 }
 
-/* Recursive listing of directory hierarchy.
-   prefix is printed before entries ("" for top-level). */
-static void list_hierarchy(FILE *disk, idisk_t *inodes, uint32_t inode_count,
-                           uint32_t dirino, const char *prefix,
-                           uint32_t inode_start_sector, uint32_t data_start, uint32_t data_end) {
-    if (dirino < 1 || dirino > inode_count) return;
-    idisk_t *din = &inodes[dirino];
-    const uint16_t IFMT = 060000;
-    const uint16_t IFDIR = 040000;
-    if ((din->i_mode & IFMT) != IFDIR) return;
+/* Library interface (see dosiero.h).  A handle is a persistent fs_t, the
+   same state -b and -s keep between queries. */
+struct dosiero {
+    fs_t *fs;
+};
 
+struct dosiero_dir {
+    fs_t *fs;
+    blockmap_iter_t it;
+    const unsigned char *blk;  /* current directory block, NULL before the first */
+    int e;                     /* next entry in blk */
     unsigned char secbuf[512];
-    // top-level prints "../" and "./" with no prefix
-    bool top = (prefix == NULL) || (prefix[0] == '\0');
-    if (top) {
-        printf("../\n");
-        printf("./\n");
-    }
+    dosiero_dirent_t ent;
+};
 
-    bool is_large = (din->i_mode & 010000) != 0;
-    if (!is_large) {
-        for (int k = 0; k < 8; k++) {
-            uint16_t sec = din->i_addr[k];
-            if (sec == 0) continue;
-            if (sec < data_start || sec > data_end) continue;
-            if (read_sector(disk, sec, secbuf) != 0) continue;
-            for (int e = 0; e < 32; e++) {
-                unsigned char *ent = &secbuf[e*16];
-                uint16_t ent_ino = le16(ent);
-                if (ent_ino == 0) continue;
-                char nm[15]; memset(nm,0,sizeof(nm)); memcpy(nm, &ent[2], 14);
-                if (strcmp(nm, ".") == 0 || strcmp(nm, "..") == 0) continue;
-                // build display name
-                char disp[4096];
-                if (top) snprintf(disp, sizeof(disp), "%s", nm);
-                else snprintf(disp, sizeof(disp), "%s%s", prefix, nm);
-
-                bool isdir = ((inodes[ent_ino].i_mode & IFMT) == IFDIR);
-                if (isdir) {
-                    printf("%s/\n", disp);
-                    // print disp/../ and disp/./ lines
-                    printf("%s/../\n", disp);
-                    printf("%s/./\n", disp);
-                    // recurse with new prefix
-                    char newpref[4096];
-                    if (top) snprintf(newpref, sizeof(newpref), "%s/", nm);
-                    else snprintf(newpref, sizeof(newpref), "%s%s/", prefix, nm);
-                    list_hierarchy(disk, inodes, inode_count, ent_ino, newpref, inode_start_sector, data_start, data_end);
-                } else {
-                    printf("%s\n", disp);
-                }
-            }
-        }
-    } else {
-        unsigned char indirbuf[512];
-        for (int k = 0; k < 8; k++) {
-            uint16_t indir = din->i_addr[k];
-            if (indir == 0) continue;
-            if (indir < data_start || indir > data_end) continue;
-            if (read_sector(disk, indir, indirbuf) != 0) continue;
-            for (int e = 0; e < 256; e++) {
-                uint16_t sec = le16(&indirbuf[e*2]);
-                if (sec == 0) continue;
-                if (sec < data_start || sec > data_end) continue;
-                if (read_sector(disk, sec, secbuf) != 0) continue;
-                for (int ee = 0; ee < 32; ee++) {
-                    unsigned char *ent = &secbuf[ee*16];
-                    uint16_t ent_ino = le16(ent);
-                    if (ent_ino == 0) continue;
-                    char nm[15]; memset(nm,0,sizeof(nm)); memcpy(nm, &ent[2], 14);
-                    if (strcmp(nm, ".") == 0 || strcmp(nm, "..") == 0) continue;
-                    char disp[4096];
-                    if (top) snprintf(disp, sizeof(disp), "%s", nm);
-                    else snprintf(disp, sizeof(disp), "%s%s", prefix, nm);
-
-                    bool isdir = ((inodes[ent_ino].i_mode & IFMT) == IFDIR);
-                    if (isdir) {
-                        printf("%s/\n", disp);
-                        printf("%s/../\n", disp);
-                        printf("%s/./\n", disp);
-                        char newpref[4096];
-                        if (top) snprintf(newpref, sizeof(newpref), "%s/", nm);
-                        else snprintf(newpref, sizeof(newpref), "%s%s/", prefix, nm);
-                        list_hierarchy(disk, inodes, inode_count, ent_ino, newpref, inode_start_sector, data_start, data_end);
-                    } else {
-                        printf("%s\n", disp);
-                    }
-                }
-            }
-        }
+dosiero_t *dosiero_open(const char *image) {
+    dosiero_t *d = malloc(sizeof(dosiero_t));
+    if (!d) { errno = ENOMEM; return NULL; }
+    errno = 0;
+    d->fs = fs_load(image, NULL);
+    if (d->fs) {
+        d->fs->persistent = true;
+        d->fs->dindex = dir_index_new(d->fs->inode_count);
     }
+    if (!d->fs || !d->fs->dindex) {
+        int err = errno ? errno : EIO;
+        fs_close(d->fs);
+        free(d);
+        errno = err;
+        return NULL;
+    }
+    return d;
 }
 
-/* Write file contents to stdout for a given file inode. Returns 0 on success, -1 on error. */
-static int extract_file_to_stdout(FILE *disk, idisk_t *inodes, uint32_t inode_count,
-                                  uint32_t ino,
-                                  uint32_t inode_start_sector, uint32_t data_start, uint32_t data_end) {
-    if (ino < 1 || ino > inode_count) return -1;
-    idisk_t *fino = &inodes[ino];
-    uint16_t mode = fino->i_mode;
-    uint16_t IFMT = 060000;
-    uint16_t IFDIR = 040000;
-    uint16_t IFCHR = 020000;
-    uint16_t IFBLK = 060000;
-    if ((mode & IFMT) == IFDIR) return -1; // not a regular file
-    if ((mode & IFMT) == IFCHR || (mode & IFMT) == IFBLK) return -1;
-    uint32_t sz = inode_size_bytes(fino);
-    unsigned char buf[512];
+void dosiero_close(dosiero_t *d) {
+    if (!d) return;
+    fs_close(d->fs);
+    free(d);
+}
 
-    bool is_large = (mode & 010000) != 0;
-    uint32_t written = 0;
-    if (!is_large) {
-        for (int k = 0; k < 8 && written < sz; k++) {
-            uint16_t sec = fino->i_addr[k];
-            if (sec == 0) continue;
-            if (sec < data_start || sec > data_end) return -1;
-            if (read_sector(disk, sec, buf) != 0) return -1;
-            uint32_t towrite = (sz - written > 512) ? 512U : (sz - written);
-            if (fwrite(buf, 1, towrite, stdout) != towrite) return -1;
-            written += towrite;
-        }
-    } else {
-        unsigned char indirbuf[512];
-        for (int k = 0; k < 8 && written < sz; k++) {
-            uint16_t indir = fino->i_addr[k];
-            if (indir == 0) continue;
-            if (indir < data_start || indir > data_end) return -1;
-            if (read_sector(disk, indir, indirbuf) != 0) return -1;
-            for (int e = 0; e < 256 && written < sz; e++) {
-                uint16_t sec = le16(&indirbuf[e*2]);
-                if (sec == 0) continue;
-                if (sec < data_start || sec > data_end) return -1;
-                if (read_sector(disk, sec, buf) != 0) return -1;
-                uint32_t towrite = (sz - written > 512) ? 512U : (sz - written);
-                if (fwrite(buf, 1, towrite, stdout) != towrite) return -1;
-                written += towrite;
-            }
+/* Mode of an allocated inode, or 0 with errno set */
+static uint16_t lib_inode(fs_t *fs, uint32_t ino) {
+    if (ino < 1 || ino > fs->inode_count) { errno = EINVAL; return 0; }
+    uint16_t mode = inode_mode(fs->inodes, ino);
+    if (!(mode & 0100000)) { errno = ENOENT; return 0; }
+    return mode;
+}
+
+uint32_t dosiero_resolve(dosiero_t *d, const char *path) {
+    fs_t *fs = d->fs;
+    if (!path || path[0] != '/') { errno = EINVAL; return 0; }
+    uint32_t ino = resolve_pathname(fs->disk, fs->inodes, fs->inode_count, fs->dindex, path,
+                                    fs->inode_start_sector, fs->data_start, fs->data_end);
+    if (ino == 0) errno = ENOENT;
+    return ino;
+}
+
+char *dosiero_path(dosiero_t *d, uint32_t ino) {
+    fs_t *fs = d->fs;
+    uint16_t mode = lib_inode(fs, ino);
+    if (!mode) return NULL;
+    if ((mode & 060000) != 040000) { errno = ENOTDIR; return NULL; }
+    parent_map_t *pm = fs_parent_map(fs);
+    if (!pm) { errno = ENOMEM; return NULL; }
+    bool fallback;
+    char *canon = canonical_path_mapped(pm, fs->inodes, ino, &fallback);
+    if (fallback)
+        canon = canonical_path(fs->disk, fs->inodes, fs->inode_count, ino,
+                               fs->inode_start_sector, fs->data_start, fs->data_end);
+    if (!canon) errno = ENOENT; /* no way back to the root */
+    return canon;
+}
+
+int dosiero_stat(dosiero_t *d, uint32_t ino, dosiero_stat_t *st) {
+    if (!lib_inode(d->fs, ino)) return -1;
+    const idisk_t *in = inode_at(d->fs->inodes, ino);
+    st->ino = ino;
+    st->mode = in->i_mode;
+    st->nlink = in->i_nlink;
+    st->uid = in->i_uid;
+    st->gid = in->i_gid;
+    st->size = inode_size_bytes(in);
+    st->mtime = in->i_mtime;
+    return 0;
+}
+
+dosiero_dir_t *dosiero_opendir(dosiero_t *d, uint32_t ino) {
+    fs_t *fs = d->fs;
+    uint16_t mode = lib_inode(fs, ino);
+    if (!mode) return NULL;
+    if ((mode & 060000) != 040000) { errno = ENOTDIR; return NULL; }
+    const blockmap_t *bm = inode_blockmap(fs->disk, inode_at(fs->inodes, ino), fs->data_start, fs->data_end);
+    dosiero_dir_t *dir = bm ? calloc(1, sizeof(dosiero_dir_t)) : NULL;
+    if (!dir) { errno = ENOMEM; return NULL; }
+    dir->fs = fs;
+    dir->it = BLOCKMAP_ITER(bm);
+    return dir;
+}
+
+/* Unreadable blocks are skipped, as the directory scans above do */
+const dosiero_dirent_t *dosiero_readdir(dosiero_dir_t *dir) {
+    for (;;) {
+        for (; dir->blk && dir->e < 32; dir->e++) {
+            const unsigned char *p = dir->blk + dir->e * 16;
+            uint16_t ino = le16(p);
+            if (ino == 0) continue;
+            dir->ent.ino = ino;
+            memcpy(dir->ent.name, p + 2, 14);
+            dir->ent.name[14] = '\0';
+            dir->e++;
+            return &dir->ent;
         }
+        uint32_t sec;
+        do {
+            if (!blockmap_next(&dir->it, &sec)) { dir->blk = NULL; return NULL; }
+            stat_kind(STAT_DIR);
+            dir->blk = read_sector(dir->fs->disk, sec, dir->secbuf);
+        } while (!dir->blk);
+        stat_add(entries, 32);
+        dir->e = 0;
     }
-    return 0;
 }
 
-/* Record a data-sector reference and report BAD-BLOCK if out of data area.
- * (used by -c; keep for compatibility) */
-static void record_sector_for_check(uint32_t ino, uint16_t sector,
-                          uint32_t data_start, uint32_t data_end,
-                          uint32_t *sector_refcount, bool *any_errors) {
-	if (sector == 0) return;
-	if (sector < data_start || sector > data_end) {
-		printf("BAD-BLOCK %u %u\n", (unsigned)ino, (unsigned)sector);
-		if (any_errors) *any_errors = true;
-		return;
-	}
-	if (sector_refcount) sector_refcount[sector]++;
+void dosiero_closedir(dosiero_dir_t *dir) {
+    free(dir);
+}
+
+ssize_t dosiero_read(dosiero_t *d, uint32_t ino, void *buf, size_t len, uint64_t off) {
+    fs_t *fs = d->fs;
+    uint16_t mode = lib_inode(fs, ino);
+    if (!mode) return -1;
+    if ((mode & 060000) == 020000 || (mode & 060000) == 060000) { errno = EINVAL; return -1; }
+    return inode_pread(fs->disk, inode_at(fs->inodes, ino), buf, len, off, fs->data_start, fs->data_end);
+}
+
+/* Parse a byte count for --offset/--length: decimal digits only */
+static bool parse_bytes(const char *arg, uint64_t *v) {
+    if (*arg < '0' || *arg > '9') return false;
+    char *endptr = NULL;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &endptr, 10);
+    if (*endptr != '\0' || errno == ERANGE) return false;
+    *v = n;
+    return true;
 }
 
 /* Main entry */
 int dosiero_main(int argc, char **argv) {
     // Usage message for errors
-    #define USAGE_MSG "Usage: %s -f <diskimage> (-x | -r | -p | -l | -a | -c) [options] [arguments]\n"
+    #define USAGE_MSG "Usage: %s -f <diskimage> (-x | -X | -r | -p | -P | -l | -a | -c | -b | -s) [options] [arguments]\n"
 
     // If -h is specified, it must be the first argument and all others are ignored
     if(argc > 1 && strcmp(argv[1], "-h") == 0){
-        fprintf(stderr, "Usage: %s -f <diskimage> (-x | -r | -p | -l | -a | -c) [options] [arguments]\n", argv[0]);
+        fprintf(stderr, "Usage: %s -f <diskimage> (-x | -X | -r | -p | -P | -l | -a | -c | -b | -s) [options] [arguments]\n", argv[0]);
         fprintf(stderr, "Options:\n");
         fprintf(stderr, "  -h               Show this help message and exit\n");
         fprintf(stderr, "  -f <diskimage>   Specify the disk image file (required)\n");
-        fprintf(stderr, "  -x               Extract mode (requires -i or -n)\n");
+        fprintf(stderr, "  -x               Extract mode (requires -i or -n); holes in the file are left out\n");
+        fprintf(stderr, "  -X <path> <dir>  Extract the file or subtree at path into host directory dir\n");
         fprintf(stderr, "  -r               Resolve pathname to i-number\n");
         fprintf(stderr, "  -p               Reverse-map i-number to pathname\n");
+        fprintf(stderr, "  -P [inum]        Print every pathname of an i-number (of all i-numbers if omitted)\n");
         fprintf(stderr, "  -l               List mode (requires -i or -n)\n");
         fprintf(stderr, "  -a               Serialize hierarchy to stdout\n");
         fprintf(stderr, "  -c               Perform filesystem consistency checking\n");
+        fprintf(stderr, "  -b [queryfile]   Batch mode: answer queries read from queryfile or stdin\n");
+        fprintf(stderr, "  -s <socket>      Serve queries on a Unix domain socket until interrupted\n");
         fprintf(stderr, "  -i               Interpret args as inode numbers (only valid with -x or -l)\n");
         fprintf(stderr, "  -n               Interpret args as names (only valid with -x or -l)\n");
+        fprintf(stderr, "  --offset <bytes> With -x, start at this byte of the file; holes then read as zeros\n");
+        fprintf(stderr, "  --length <bytes> With -x, copy at most this many bytes\n");
+        fprintf(stderr, "  --stats          Report sector reads, cache use and time per phase on stderr\n");
         return EXIT_SUCCESS;
     }
 
     bool f_seen = false;
     char *diskimage = NULL;
-    bool x_seen = false, r_seen = false, p_seen = false;
+    bool x_seen = false, X_seen = false, r_seen = false, p_seen = false, P_seen = false;
     bool l_seen = false, a_seen = false, c_seen = false;
+    bool b_seen = false, s_seen = false;
     bool i_seen = false, n_seen = false;
+    bool stats_seen = false;
+    bool offset_seen = false, length_seen = false;
+    uint64_t offset = 0, length = UINT64_MAX;
 
     // Parse options in any order, even after non-option arguments
     for(int i = 1; i < argc; i++){
@@ -458,6 +2500,10 @@ int dosiero_main(int argc, char **argv) {
             if (x_seen) { fprintf(stderr, "Error: -x specified more than once\n"); return EXIT_FAILURE; }
             x_seen = true;
         }
+        else if (strcmp(argv[i], "-X") == 0) {
+            if (X_seen) { fprintf(stderr, "Error: -X specified more than once\n"); return EXIT_FAILURE; }
+            X_seen = true;
+        }
         else if (strcmp(argv[i], "-r") == 0) {
             if (r_seen) { fprintf(stderr, "Error: -r specified more than once\n"); return EXIT_FAILURE; }
             r_seen = true;
@@ -466,6 +2512,10 @@ int dosiero_main(int argc, char **argv) {
             if (p_seen) { fprintf(stderr, "Error: -p specified more than once\n"); return EXIT_FAILURE; }
             p_seen = true;
         }
+        else if (strcmp(argv[i], "-P") == 0) {
+            if (P_seen) { fprintf(stderr, "Error: -P specified more than once\n"); return EXIT_FAILURE; }
+            P_seen = true;
+        }
         else if (strcmp(argv[i], "-l") == 0) {
             if (l_seen) { fprintf(stderr, "Error: -l specified more than once\n"); return EXIT_FAILURE; }
             l_seen = true;
@@ -478,6 +2528,14 @@ int dosiero_main(int argc, char **argv) {
             if (c_seen) { fprintf(stderr, "Error: -c specified more than once\n"); return EXIT_FAILURE; }
             c_seen = true;
         }
+        else if (strcmp(argv[i], "-b") == 0) {
+            if (b_seen) { fprintf(stderr, "Error: -b specified more than once\n"); return EXIT_FAILURE; }
+            b_seen = true;
+        }
+        else if (strcmp(argv[i], "-s") == 0) {
+            if (s_seen) { fprintf(stderr, "Error: -s specified more than once\n"); return EXIT_FAILURE; }
+            s_seen = true;
+        }
         else if (strcmp(argv[i], "-i") == 0) {
             if (i_seen) { fprintf(stderr, "Error: -i specified more than once\n"); return EXIT_FAILURE; }
             i_seen = true;
@@ -486,6 +2544,28 @@ int dosiero_main(int argc, char **argv) {
             if (n_seen) { fprintf(stderr, "Error: -n specified more than once\n"); return EXIT_FAILURE; }
             n_seen = true;
         }
+        else if (strcmp(argv[i], "--offset") == 0 || strcmp(argv[i], "--length") == 0) {
+            bool is_offset = argv[i][2] == 'o';
+            if (is_offset ? offset_seen : length_seen) {
+                fprintf(stderr, "Error: %s specified more than once\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            if (i + 1 >= argc || !parse_bytes(argv[i + 1], is_offset ? &offset : &length)) {
+                fprintf(stderr, "Error: %s requires a byte count\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            if (is_offset) offset_seen = true;
+            else length_seen = true;
+            i++;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            if (stats_seen) { fprintf(stderr, "Error: --stats specified more than once\n"); return EXIT_FAILURE; }
+#ifndef STATS
+            fprintf(stderr, "Error: --stats is not available in this build (see make stats)\n");
+            return EXIT_FAILURE;
+#endif
+            stats_seen = true;
+        }
         else if (argv[i][0] == '-') {
             fprintf(stderr, "Error: Unknown option: %s\n", argv[i]);
             return EXIT_FAILURE;
@@ -498,9 +2578,9 @@ int dosiero_main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    int modes = x_seen + r_seen + p_seen + l_seen + a_seen + c_seen;
+    int modes = x_seen + X_seen + r_seen + p_seen + P_seen + l_seen + a_seen + c_seen + b_seen + s_seen;
     if (modes != 1) {
-        fprintf(stderr, "Error: Exactly one of -x, -r, -p, -l, -a, -c must be specified\n");
+        fprintf(stderr, "Error: Exactly one of -x, -X, -r, -p, -P, -l, -a, -c, -b, -s must be specified\n");
         return EXIT_FAILURE;
     }
 
@@ -515,14 +2595,21 @@ int dosiero_main(int argc, char **argv) {
             return EXIT_FAILURE;
         }
     }
+    if ((offset_seen || length_seen) && !x_seen) {
+        fprintf(stderr, "Error: --offset and --length only allowed with -x\n");
+        return EXIT_FAILURE;
+    }
 
     // Count non-option arguments (those not starting with '-')
     int nonopt_count = 0;
-    char *nonopt_arg = NULL;
+    char *nonopt_arg = NULL, *nonopt_arg2 = NULL;
     for (int i = 1; i < argc; i++) {
-        if (argv[i][0] != '-' && (i == 1 || strcmp(argv[i-1], "-f") != 0)) {
+        if (argv[i][0] != '-' && (i == 1 || (strcmp(argv[i-1], "-f") != 0 &&
+                                              strcmp(argv[i-1], "--offset") != 0 &&
+                                              strcmp(argv[i-1], "--length") != 0))) {
             nonopt_count++;
             if (!nonopt_arg) nonopt_arg = argv[i];
+            else if (!nonopt_arg2) nonopt_arg2 = argv[i];
         }
     }
 
@@ -534,6 +2621,14 @@ int dosiero_main(int argc, char **argv) {
         }
     }
 
+    // Validate invocation for -X mode
+    if (X_seen) {
+        if (nonopt_count != 2 || nonopt_arg[0] != '/') {
+            fprintf(stderr, USAGE_MSG, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
     // Validate invocation for -p mode
     if (p_seen) {
         if (nonopt_count != 1 || !nonopt_arg) {
@@ -548,6 +2643,19 @@ int dosiero_main(int argc, char **argv) {
         }
     }
 
+    // Validate invocation for -P mode
+    if (P_seen) {
+        if (nonopt_count > 1) {
+            fprintf(stderr, USAGE_MSG, argv[0]);
+            return EXIT_FAILURE;
+        }
+        char *endptr = NULL;
+        if (nonopt_arg && (*nonopt_arg == '\0' || strtol(nonopt_arg, &endptr, 10) <= 0 || *endptr != '\0')) {
+            fprintf(stderr, USAGE_MSG, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
     // Validate invocation for -x mode
     if (x_seen) {
         if (nonopt_count != 1 || !nonopt_arg || !(i_seen ^ n_seen)) {
@@ -556,6 +2664,14 @@ int dosiero_main(int argc, char **argv) {
         }
     }
 
+    // Validate invocation for -l mode
+    if (l_seen && n_seen) {
+        if (nonopt_count != 1 || !nonopt_arg) {
+            fprintf(stderr, USAGE_MSG, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
     // Validate invocation for -a mode
     if (a_seen) {
         if (nonopt_count != 0) {
@@ -572,130 +2688,60 @@ int dosiero_main(int argc, char **argv) {
         }
     }
 
-    /* Open disk image once for use by modes */
-    FILE *disk = fopen(diskimage, "rb");
-    if (!disk) {
-        fprintf(stderr, "Error: Unable to open disk image file '%s'\n", diskimage);
-        return EXIT_FAILURE;
-    }
-
-    /* Read superblock (sector 1) */
-    unsigned char sbuf[512];
-    if (fseek(disk, 512, SEEK_SET) != 0 || fread(sbuf, 1, 512, disk) != 512) {
-        fprintf(stderr, "Error: Unable to read superblock from '%s'\n", diskimage);
-        fclose(disk);
-        return EXIT_FAILURE;
-    }
-    uint16_t s_isize = le16(&sbuf[0]);
-    uint16_t s_fsize = le16(&sbuf[2]);
-    uint16_t s_nfree = le16(&sbuf[4]);
-    uint16_t s_free[100];
-    for (int i = 0; i < 100; i++) s_free[i] = le16(&sbuf[6 + i*2]);
-    /* silence unused-variable warnings for fields we don't yet use */
-    (void)s_nfree;
-    (void)s_free;
-
-    /* Inode area layout */
-    const uint16_t INODES_PER_SECTOR = 16;
-    uint32_t inode_sectors = s_isize;
-    uint32_t inode_count = inode_sectors * INODES_PER_SECTOR;
-    uint32_t inode_start_sector = 2;
-    uint32_t data_start = inode_start_sector + inode_sectors;
-    uint32_t data_end = (s_fsize > 0) ? (s_fsize - 1) : 0;
-
-    /* read inode area */
-    size_t inode_area_bytes = inode_sectors * 512;
-    unsigned char *inode_area = malloc(inode_area_bytes);
-    if (!inode_area) { fclose(disk); return EXIT_FAILURE; }
-    if (fseek(disk, inode_start_sector * 512UL, SEEK_SET) != 0 ||
-        fread(inode_area, 1, inode_area_bytes, disk) != inode_area_bytes) {
-        free(inode_area); fclose(disk); return EXIT_FAILURE;
-    }
-    idisk_t *inodes = calloc(inode_count + 1, sizeof(idisk_t));
-    if (!inodes) { free(inode_area); fclose(disk); return EXIT_FAILURE; }
-    for (uint32_t ino = 1; ino <= inode_count; ino++) {
-        unsigned char *p = inode_area + ((ino-1) * 32);
-        inodes[ino].i_mode = le16(&p[0]);
-        inodes[ino].i_nlink = p[2];
-        inodes[ino].i_uid = p[3];
-        inodes[ino].i_gid = p[4];
-        inodes[ino].i_size0 = p[5];
-        inodes[ino].i_size1 = le16(&p[6]);
-        for (int k = 0; k < 8; k++) inodes[ino].i_addr[k] = le16(&p[8 + k*2]);
+    // Validate invocation for -b mode
+    if (b_seen) {
+        if (nonopt_count > 1) {
+            fprintf(stderr, USAGE_MSG, argv[0]);
+            return EXIT_FAILURE;
+        }
     }
-    free(inode_area);
 
-    /* Handle modes that were implemented: -r (resolve), -p (print pathname),
-       -l -n (list names), -x -n (extract by name) or -x -i (extract by inode) */
-    if (r_seen) {
-        uint32_t ino = resolve_pathname(disk, inodes, inode_count, nonopt_arg,
-                                        inode_start_sector, data_start, data_end);
-        if (ino == 0) { fclose(disk); free(inodes); return EXIT_FAILURE; }
-        printf("%u\n", (unsigned)ino);
-        fclose(disk); free(inodes); return EXIT_SUCCESS;
+    // Validate invocation for -s mode
+    if (s_seen) {
+        if (nonopt_count != 1 || !nonopt_arg) {
+            fprintf(stderr, USAGE_MSG, argv[0]);
+            return EXIT_FAILURE;
+        }
     }
 
-    if (p_seen) {
-        long inum = strtol(nonopt_arg, NULL, 10);
-        if (inum < 1 || (uint32_t)inum > inode_count) { fclose(disk); free(inodes); return EXIT_FAILURE; }
-        // verify inode is allocated and a directory
-        if (!(inodes[inum].i_mode & 0100000)) { fclose(disk); free(inodes); return EXIT_FAILURE; }
-        if ((inodes[inum].i_mode & 060000) != 040000) { fclose(disk); free(inodes); return EXIT_FAILURE; }
-        char *canon = canonical_path(disk, inodes, inode_count, (uint32_t)inum,
-                                     inode_start_sector, data_start, data_end);
-        if (!canon) { fclose(disk); free(inodes); return EXIT_FAILURE; }
-        printf("%s\n", canon);
-        free(canon);
-        fclose(disk); free(inodes); return EXIT_SUCCESS;
-    }
+#ifdef STATS
+    if (stats_seen) stats_start();
+#endif
 
-    if (l_seen && n_seen) {
-        if (nonopt_count != 1 || !nonopt_arg) { fclose(disk); free(inodes); return EXIT_FAILURE; }
-        uint32_t dirino = resolve_pathname(disk, inodes, inode_count, nonopt_arg,
-                                      inode_start_sector, data_start, data_end);
-        if (dirino == 0) { fclose(disk); free(inodes); return EXIT_FAILURE; }
-        // call recursive listing with empty prefix for top-level
-        list_hierarchy(disk, inodes, inode_count, dirino, "", inode_start_sector, data_start, data_end);
-        fclose(disk); free(inodes); return EXIT_SUCCESS;
-    }
+    /* Open disk image once for use by modes */
+    fs_t *fs = fs_open(diskimage);
+    if (!fs) return EXIT_FAILURE;
+#ifdef STATS
+    if (stats_seen) stats_phase(STAT_PH_QUERY);
+#endif
 
-    if (x_seen) {
-        // interpret argument according to -i or -n
-        uint32_t ino = 0;
-        if (i_seen) {
-            char *endptr = NULL;
-            long inum = strtol(nonopt_arg, &endptr, 10);
-            if (*nonopt_arg == '\0' || *endptr != '\0' || inum <= 0) { fclose(disk); free(inodes); return EXIT_FAILURE; }
-            ino = (uint32_t)inum;
-        } else {
-            ino = resolve_pathname(disk, inodes, inode_count, nonopt_arg,
-                                   inode_start_sector, data_start, data_end);
-            if (ino == 0) { fclose(disk); free(inodes); return EXIT_FAILURE; }
-        }
-        // verify regular file
-        uint16_t IFMT = 060000;
-        uint16_t mode = inodes[ino].i_mode;
-        if ((mode & IFMT) == 040000) { fclose(disk); free(inodes); return EXIT_FAILURE; } // directory
-        if (extract_file_to_stdout(disk, inodes, inode_count, ino, inode_start_sector, data_start, data_end) != 0) {
-            fclose(disk); free(inodes); return EXIT_FAILURE;
+    int status;
+    if (X_seen) {
+        status = run_restore(fs, nonopt_arg, nonopt_arg2);
+    } else if (s_seen) {
+        status = run_server(fs, nonopt_arg);
+    } else if (b_seen) {
+        FILE *in = stdin;
+        if (nonopt_arg && !(in = fopen(nonopt_arg, "r"))) {
+            fprintf(stderr, "Error: Unable to open query file '%s'\n", nonopt_arg);
+            fs_close(fs);
+            return EXIT_FAILURE;
         }
-        fclose(disk); free(inodes); return EXIT_SUCCESS;
-    }
-
-    if (a_seen) {
-        // archive mode not implemented fully here (placeholder)
-        fclose(disk); free(inodes); return EXIT_SUCCESS;
+        status = run_batch(fs, in, stdout);
+        if (in != stdin) fclose(in);
+    } else if (offset_seen || length_seen) {
+        status = run_extract_range(fs, i_seen, nonopt_arg, offset, length, stdout);
+    } else {
+        char mode = x_seen ? 'x' : r_seen ? 'r' : p_seen ? 'p' : P_seen ? 'P' : l_seen ? 'l' : a_seen ? 'a' : 'c';
+        status = run_query(fs, mode, i_seen, nonopt_arg, stdout);
     }
-
-    if (c_seen) {
-        // The -c implementation previously added is left intact (not duplicated here).
-        // For brevity we fall back to returning success (or you may reuse earlier -c code).
-        // To keep tests passing for now, run the earlier consistency checks if desired.
-        fclose(disk); free(inodes); return EXIT_SUCCESS;
+#ifdef STATS
+    if (stats_seen) {
+        fflush(stdout);
+        stats_phase(STAT_PH_OUTPUT);
+        stats_report(stderr);
     }
-
-    // default
-    fclose(disk);
-    free(inodes);
-    return EXIT_SUCCESS;
+#endif
+    fs_close(fs);
+    return status;
 }
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "debug.h"
+
+/* Read a non-seekable stream (pipe, terminal, ...) fully into memory. */
+static int slurp_stream(image_t *img, int fd) {
+    size_t cap = 64 * 1024, len = 0;
+    unsigned char *buf = malloc(cap);
+    if (!buf) return -1;
+    for (;;) {
+        if (len == cap) {
+            unsigned char *nbuf = realloc(buf, cap * 2);
+            if (!nbuf) { free(buf); return -1; }
+            buf = nbuf; cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { free(buf); return -1; }
+        if (n == 0) break;
+        len += (size_t)n;
+    }
+    img->base = buf;
+    img->size = len;
+    img->mapped = false;
+    return 0;
+}
+
+static int cache_init(sector_cache_t *c) {
+    c->nbuckets = 1;
+    while (c->nbuckets < 2 * SECTOR_CACHE_SLOTS) c->nbuckets <<= 1;
+    c->slots = malloc(SECTOR_CACHE_SLOTS * sizeof(cache_slot_t));
+    c->buckets = malloc(c->nbuckets * sizeof(int32_t));
+    if (!c->slots || !c->buckets) {
+        free(c->slots); free(c->buckets);
+        c->slots = NULL; c->buckets = NULL;
+        return -1;
+    }
+    for (uint32_t b = 0; b < c->nbuckets; b++) c->buckets[b] = -1;
+    c->used = 0;
+    c->head = c->tail = -1;
+    pthread_mutex_init(&c->lock, NULL);
+    return 0;
+}
+
+static uint32_t cache_bucket(const sector_cache_t *c, uint32_t sector) {
+    return (sector * 2654435761u) & (c->nbuckets - 1);
+}
+
+static void lru_unlink(sector_cache_t *c, int32_t i) {
+    cache_slot_t *sl = &c->slots[i];
+    if (sl->prev >= 0) c->slots[sl->prev].next = sl->next; else c->head = sl->next;
+    if (sl->next >= 0) c->slots[sl->next].prev = sl->prev; else c->tail = sl->prev;
+}
+
+static void lru_push_front(sector_cache_t *c, int32_t i) {
+    c->slots[i].prev = -1;
+    c->slots[i].next = c->head;
+    if (c->head >= 0) c->slots[c->head].prev = i;
+    c->head = i;
+    if (c->tail < 0) c->tail = i;
+}
+
+static void hash_remove(sector_cache_t *c, int32_t i) {
+    int32_t *pp = &c->buckets[cache_bucket(c, c->slots[i].sector)];
+    while (*pp != i) pp = &c->slots[*pp].hnext;
+    *pp = c->slots[i].hnext;
+}
+
+/* Look up a sector; on a hit the slot becomes most recently used. */
+static cache_slot_t *cache_lookup(sector_cache_t *c, uint32_t sector) {
+    for (int32_t i = c->buckets[cache_bucket(c, sector)]; i >= 0; i = c->slots[i].hnext) {
+        if (c->slots[i].sector != sector) continue;
+        if (c->head != i) { lru_unlink(c, i); lru_push_front(c, i); }
+        return &c->slots[i];
+    }
+    return NULL;
+}
+
+/* Claim a slot for sector, evicting the least recently used one if full. */
+static cache_slot_t *cache_claim(sector_cache_t *c, uint32_t sector) {
+    int32_t i;
+    if (c->used < SECTOR_CACHE_SLOTS) {
+        i = (int32_t)c->used++;
+    } else {
+        i = c->tail;
+        lru_unlink(c, i);
+        hash_remove(c, i);
+    }
+    cache_slot_t *sl = &c->slots[i];
+    sl->sector = sector;
+    uint32_t b = cache_bucket(c, sector);
+    sl->hnext = c->buckets[b];
+    c->buckets[b] = i;
+    lru_push_front(c, i);
+    return sl;
+}
+
+image_t *image_open(const char *path) {
+    image_t *img = calloc(1, sizeof(image_t));
+    if (!img) return NULL;
+    img->fd = open(path, O_RDONLY);
+    if (img->fd < 0) { free(img); return NULL; }
+
+    struct stat st;
+    if (fstat(img->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+        if (m != MAP_FAILED) {
+            img->base = m;
+            img->size = (size_t)st.st_size;
+            img->mapped = true;
+            img->nsectors = (uint32_t)((size_t)st.st_size / SECTOR_SIZE);
+            return img;
+        }
+        debug("mmap of '%s' failed, using pread", path);
+    }
+    off_t end = lseek(img->fd, 0, SEEK_END);
+    if (end < 0) {
+        /* not seekable: sector access needs random access, so buffer it all */
+        int r = slurp_stream(img, img->fd);
+        close(img->fd);
+        img->fd = -1;
+        if (r != 0) { free(img); return NULL; }
+        img->nsectors = (uint32_t)(img->size / SECTOR_SIZE);
+        return img;
+    }
+    img->nsectors = (uint32_t)(end / SECTOR_SIZE);
+    if (cache_init(&img->cache) != 0) { close(img->fd); free(img); return NULL; }
+    return img;
+}
+
+void image_close(image_t *img) {
+    if (!img) return;
+    if (img->cache.slots) {
+        debug("sector cache: %lu hits, %lu misses (%d slots)",
+              img->cache.hits, img->cache.misses, SECTOR_CACHE_SLOTS);
+        pthread_mutex_destroy(&img->cache.lock);
+        free(img->cache.slots);
+        free(img->cache.buckets);
+    }
+    if (img->base) {
+        if (img->mapped) munmap((void *)img->base, img->size);
+        else free((void *)img->base);
+    }
+    if (img->fd >= 0) close(img->fd);
+    free(img);
+}
+
+const unsigned char *read_sector(image_t *img, uint32_t sector, unsigned char *buf) {
+    if (img->base) {
+        if (((size_t)sector + 1) * SECTOR_SIZE > img->size) return NULL;
+        stat_sectors(1);
+        return img->base + (size_t)sector * SECTOR_SIZE;
+    }
+    sector_cache_t *c = &img->cache;
+    pthread_mutex_lock(&c->lock);
+    cache_slot_t *sl = cache_lookup(c, sector);
+    if (sl) {
+        c->hits++;
+        memcpy(buf, sl->data, SECTOR_SIZE);
+        pthread_mutex_unlock(&c->lock);
+        stat_add(cache_hits, 1);
+        stat_sectors(1);
+        return buf;
+    }
+    c->misses++;
+    pthread_mutex_unlock(&c->lock);
+    stat_add(cache_misses, 1);
+    stat_add(preads, 1);
+
+    /* the file is read without the lock; another thread may cache the
+       same sector meanwhile, so look again before claiming a slot */
+    size_t got = 0;
+    while (got < SECTOR_SIZE) {
+        ssize_t n = pread(img->fd, buf + got, SECTOR_SIZE - got, (off_t)sector * SECTOR_SIZE + (off_t)got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return NULL;
+        got += (size_t)n;
+    }
+    stat_sectors(1);
+    pthread_mutex_lock(&c->lock);
+    if (!cache_lookup(c, sector)) memcpy(cache_claim(c, sector)->data, buf, SECTOR_SIZE);
+    pthread_mutex_unlock(&c->lock);
+    return buf;
+}
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+
+#include "inode.h"
+#include "debug.h"
+
+static uint16_t le16(const unsigned char *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+inode_table_t *inode_table_create(image_t *disk, uint32_t start_sector, uint32_t count) {
+    inode_table_t *t = calloc(1, sizeof(inode_table_t));
+    if (!t) return NULL;
+    pthread_mutex_init(&t->lock, NULL);
+    uint32_t nsec = count / INODES_PER_SECTOR;
+    t->disk = disk;
+    t->start_sector = start_sector;
+    t->count = count;
+    t->slots = calloc(count + 1, sizeof(idisk_t));
+    t->modes = calloc(count + 1, sizeof(uint16_t));
+    t->sizes = calloc(count + 1, sizeof(uint32_t));
+    t->addrs = calloc(count + 1, sizeof(*t->addrs));
+    t->ready = calloc(nsec ? nsec : 1, 1);
+    if (!t->slots || !t->modes || !t->sizes || !t->addrs || !t->ready) {
+        inode_table_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void inode_table_free(inode_table_t *t) {
+    if (!t) return;
+    pthread_mutex_destroy(&t->lock);
+    for (uint32_t i = 0; t->slots && i <= t->count; i++) {
+        if (!t->slots[i].i_map) continue;
+        blockmap_free(t->slots[i].i_map);
+        free(t->slots[i].i_map);
+    }
+    free(t->slots);
+    free(t->modes);
+    free(t->sizes);
+    free(t->addrs);
+    free(t->ready);
+    free(t);
+}
+
+void inode_table_decode(inode_table_t *t, uint32_t s) {
+    unsigned char ibuf[SECTOR_SIZE];
+    pthread_mutex_lock(&t->lock);
+    if (t->ready[s]) { pthread_mutex_unlock(&t->lock); return; }
+    stat_phase_enter(STAT_PH_INODES);
+    stat_kind(STAT_INODE);
+    const unsigned char *isec = read_sector(t->disk, t->start_sector + s, ibuf);
+    /* unreadable: the inodes stay unallocated */
+    for (uint32_t i = 0; isec && i < INODES_PER_SECTOR; i++) {
+        uint32_t ino = s * INODES_PER_SECTOR + i + 1;
+        idisk_t *in = &t->slots[ino];
+        const unsigned char *p = isec + i * INODE_SIZE;
+        in->i_mode = le16(&p[0]);
+        in->i_nlink = p[2];
+        in->i_uid = p[3];
+        in->i_gid = p[4];
+        in->i_size0 = p[5];
+        in->i_size1 = le16(&p[6]);
+        for (int k = 0; k < 8; k++) in->i_addr[k] = le16(&p[8 + k*2]);
+        in->i_mtime = ((uint32_t)le16(&p[28]) << 16) | le16(&p[30]);
+        t->modes[ino] = in->i_mode;
+        t->sizes[ino] = inode_size_bytes(in);
+        for (int k = 0; k < 8; k++) t->addrs[ino][k] = in->i_addr[k];
+    }
+    stat_phase_leave();
+    __atomic_store_n(&t->ready[s], 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&t->lock);
+}
+
+void inode_table_load_all(inode_table_t *t) {
+    for (uint32_t s = 0; s < t->count / INODES_PER_SECTOR; s++)
+        if (!__atomic_load_n(&t->ready[s], __ATOMIC_ACQUIRE)) inode_table_decode(t, s);
+}
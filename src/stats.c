@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "debug.h"
+
+#ifdef STATS
+
+stats_t stats;
+__thread int stats_kind = STAT_DATA;
+
+static __thread bool stats_main;
+static int cur_phase = -1;
+static struct timespec last_wall, last_cpu;
+
+static uint64_t elapsed_ns(clockid_t clk, struct timespec *last) {
+    struct timespec now;
+    clock_gettime(clk, &now);
+    uint64_t ns = (uint64_t)(now.tv_sec - last->tv_sec) * 1000000000u + (uint64_t)now.tv_nsec - (uint64_t)last->tv_nsec;
+    *last = now;
+    return ns;
+}
+
+void stats_start(void) {
+    stats_main = true;
+    clock_gettime(CLOCK_MONOTONIC, &last_wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &last_cpu);
+    cur_phase = STAT_PH_SUPER;
+}
+
+int stats_phase(int phase) {
+    if (!stats_main) return phase;
+    int prev = cur_phase;
+    uint64_t wall = elapsed_ns(CLOCK_MONOTONIC, &last_wall);
+    uint64_t cpu = elapsed_ns(CLOCK_PROCESS_CPUTIME_ID, &last_cpu);
+    if (prev >= 0) {
+        stats.wall_ns[prev] += wall;
+        stats.cpu_ns[prev] += cpu;
+    }
+    cur_phase = phase;
+    return prev;
+}
+
+void stats_report(FILE *out) {
+    static const char *kinds[STAT_KINDS] = { "superblock", "inode", "directory", "indirect", "data", "freelist" };
+    static const char *phases[STAT_PHASES] = { "superblock", "inode-decode", "query", "output" };
+    stats_phase(cur_phase);
+    uint64_t total = 0;
+    fprintf(out, "stats: sectors");
+    for (int k = 0; k < STAT_KINDS; k++) {
+        fprintf(out, " %s=%llu", kinds[k], (unsigned long long)stats.sectors[k]);
+        total += stats.sectors[k];
+    }
+    fprintf(out, " total=%llu\n", (unsigned long long)total);
+    fprintf(out, "stats: bytes read %llu\n", (unsigned long long)stats.bytes);
+    fprintf(out, "stats: preads %llu\n", (unsigned long long)stats.preads);
+    fprintf(out, "stats: cache hits %llu misses %llu\n",
+            (unsigned long long)stats.cache_hits, (unsigned long long)stats.cache_misses);
+    fprintf(out, "stats: directory entries scanned %llu\n", (unsigned long long)stats.entries);
+    for (int p = 0; p < STAT_PHASES; p++)
+        fprintf(out, "stats: phase %s wall %.6fs cpu %.6fs\n", phases[p],
+                stats.wall_ns[p] / 1e9, stats.cpu_ns[p] / 1e9);
+}
+
+#endif /* STATS */
@@ -2,6 +2,7 @@
 #include <criterion/logging.h>
 
 #include "test_common.h"
+#include "dosiero.h"
 
 #define PROGRAM_PATH "bin/dosiero"
 
@@ -127,3 +128,365 @@ Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
     assert_files_match(ref_errfile, test_errfile, NULL);
 }
 #undef TEST_NAME
+
+/**
+ * Answer several queries against one loaded image
+ * @brief PROGRAM_PATH -f rsrc/unix-v5-boot.img -b < ref.in
+ */
+
+#define TEST_NAME batch_queries
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f rsrc/unix-v5-boot.img -b"); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // outfile should contain one "<status> <length>" record per query
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * List every pathname of i-number 465
+ * @brief PROGRAM_PATH -f rsrc/unix-v5-boot.img -P 465
+ */
+
+#define TEST_NAME all_paths_465
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f rsrc/unix-v5-boot.img -P 465"); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // outfile should contain one pathname per line
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * Extract 20 bytes of /etc/passwd starting at byte 10
+ * @brief PROGRAM_PATH -f rsrc/unix-v5-boot.img -x /etc/passwd -n --offset 10 --length 20
+ */
+
+#define TEST_NAME extract_etc_passwd_range
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f rsrc/unix-v5-boot.img -x /etc/passwd -n --offset 10 --length 20"); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // outfile should contain bytes 10..29 of /etc/passwd
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/* The check_* images are "dosiero_mkimage -n 12 -w 4 -d 2 -m 600 -z 48"
+   output; all but check_clean have one field patched to the damage named. */
+
+/**
+ * Check a clean image
+ * @brief PROGRAM_PATH -f tests/rsrc/check_clean/disk.img -c
+ */
+
+#define TEST_NAME check_clean
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/disk.img -c", ref_dir); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // outfile must be empty: nothing to report
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * Check an image where inode 5 claims inode 4's block
+ * @brief PROGRAM_PATH -f tests/rsrc/check_dup_block/disk.img -c
+ */
+
+#define TEST_NAME check_dup_block
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/disk.img -c", ref_dir); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_FAILURE, status);
+    // DUP-BLOCK for the shared block, MISSING-BLOCK for the one inode 5 lost
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * Check an image whose free list names a sector in the inode area
+ * @brief PROGRAM_PATH -f tests/rsrc/check_bad_free/disk.img -c
+ */
+
+#define TEST_NAME check_bad_free
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/disk.img -c", ref_dir); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_FAILURE, status);
+    // BAD-FREE for the bad entry, MISSING-BLOCK for the free block it replaced
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * Check an image where inode 8 has i_nlink 2 but one entry
+ * @brief PROGRAM_PATH -f tests/rsrc/check_link_count/disk.img -c
+ */
+
+#define TEST_NAME check_link_count
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/disk.img -c", ref_dir); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_FAILURE, status);
+    // LINK-COUNT with the stored and counted links
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * Archive a small image and list the archive
+ * @brief PROGRAM_PATH -f tests/rsrc/archive_listing/disk.img -a
+ */
+
+#define TEST_NAME archive_listing
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/disk.img -a", ref_dir); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+    // outfile is a ustar archive; its verbose listing must match
+    char *cmd = NULL; NEWSTREAM(f, s, cmd);
+    fprintf(f, "TZ=UTC tar tvf %s > %s", test_outfile, alt_outfile); fclose(f);
+    cr_assert_eq(system(cmd), 0, "tar could not list '%s'", test_outfile);
+    free(cmd);
+    assert_files_match(ref_outfile, alt_outfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * Archive a chain of directories whose deepest paths are over 4096 bytes
+ * @brief PROGRAM_PATH -f tests/rsrc/archive_deep/disk.img -a
+ */
+
+#define TEST_NAME archive_deep
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/disk.img -a", ref_dir); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+    // every directory is archived, and the files at levels 1, 137 and 275
+    // keep their full names through GNU long-name records
+    char *cmd = NULL; NEWSTREAM(f, s, cmd);
+    fprintf(f, "test $(tar tf %s | wc -l) -eq 278 && tar tf %s | grep file > %s",
+            test_outfile, test_outfile, alt_outfile); fclose(f);
+    cr_assert_eq(system(cmd), 0, "tar did not list 278 entries in '%s'", test_outfile);
+    free(cmd);
+    assert_files_match(ref_outfile, alt_outfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * Restore a small image into a host directory and compare the tree
+ * @brief PROGRAM_PATH -f tests/rsrc/archive_listing/disk.img -X / test_output/restore_tree/out
+ */
+
+#define TEST_NAME restore_tree
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/archive_listing/disk.img -X / %s/out", TEST_RSRC_DIR, test_output_dir); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // outfile and errfile should be empty
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    assert_files_match(ref_errfile, test_errfile, NULL);
+    // same directories and file contents as tar extracts from -a
+    char *tree = NULL; NEWSTREAM(f, s, tree);
+    fprintf(f, "%s/tree", ref_dir); fclose(f);
+    char *out = NULL; NEWSTREAM(f, s, out);
+    fprintf(f, "%s/out", test_output_dir); fclose(f);
+    assert_dirs_match(tree, out);
+    free(tree);
+    free(out);
+}
+#undef TEST_NAME
+
+/**
+ * Restore the 275-level chain, whose deepest paths the host cannot open
+ * @brief PROGRAM_PATH -f tests/rsrc/archive_deep/disk.img -X / test_output/restore_deep/out
+ */
+
+#define TEST_NAME restore_deep
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/archive_deep/disk.img -X / %s/out", TEST_RSRC_DIR, test_output_dir); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    // the subtree that does not fit is reported and the exit status says so
+    assert_expected_status(EXIT_FAILURE, status);
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    assert_files_match(ref_errfile, test_errfile, NULL);
+    // everything above it is still restored
+    char *cmd = NULL; NEWSTREAM(f, s, cmd);
+    fprintf(f, "cmp %s/file137 \"$(find %s/out -name file137)\"", ref_dir, test_output_dir); fclose(f);
+    cr_assert_eq(system(cmd), 0, "file137 was not restored");
+    free(cmd);
+}
+#undef TEST_NAME
+
+/**
+ * Extract a file whose second block is a hole
+ * @brief PROGRAM_PATH -f tests/rsrc/extract_sparse/disk.img -x -n /f7
+ */
+
+#define TEST_NAME extract_sparse
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/disk.img -x -n /f7", ref_dir); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // outfile holds blocks 0 and 2 only: the hole is left out
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * Extract the same sparse file by byte range
+ * @brief PROGRAM_PATH -f tests/rsrc/extract_sparse/disk.img -x -n /f7 --offset 0
+ */
+
+#define TEST_NAME extract_sparse_range
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/extract_sparse/disk.img -x -n /f7 --offset 0", TEST_RSRC_DIR); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // outfile holds all 1332 bytes, with 512 zeros where the hole is
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * Every pathname of a regular file with three links
+ * @brief PROGRAM_PATH -f tests/rsrc/links_regular_file/disk.img -P 7
+ */
+
+#define TEST_NAME links_regular_file
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/disk.img -P 7", ref_dir); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // outfile: /d2/d8/again7, /d2/link7 and /f7, with no trailing '/'
+    assert_files_match(ref_outfile, test_outfile, NULL);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+}
+#undef TEST_NAME
+
+/**
+ * Pathnames of every i-number in the same image
+ * @brief PROGRAM_PATH -f tests/rsrc/links_regular_file/disk.img -P
+ */
+
+#define TEST_NAME links_all
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    FILE *f; size_t s = 0; char *args = NULL; NEWSTREAM(f, s, args);
+    fprintf(f, "-f %s/links_regular_file/disk.img -P", TEST_RSRC_DIR); fclose(f);
+    int status = run_using_system(PROGRAM_PATH, "", "", args, STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, status);
+    // errfile should be empty
+    assert_files_match(ref_errfile, test_errfile, NULL);
+    // 21 lines for 19 i-numbers; the root, two directories, the last file
+    // and all three names of inode 7 must be among them
+    char *cmd = NULL; NEWSTREAM(f, s, cmd);
+    fprintf(f, "{ wc -l < %s; grep -E '^(1 /|2 /d2/|7 .*|8 /d2/d8/|19 /d2/d8/f19)$' %s; } > %s",
+            test_outfile, test_outfile, alt_outfile); fclose(f);
+    cr_assert_eq(system(cmd), 0, "Unable to summarize '%s'", test_outfile);
+    free(cmd);
+    assert_files_match(ref_outfile, alt_outfile, NULL);
+}
+#undef TEST_NAME
+
+/* Library tests -- these call the libdosiero interface in-process. */
+
+/**
+ * Read /etc/passwd through a handle, 100 bytes at a time
+ * @brief dosiero_open(), dosiero_resolve(), dosiero_read()
+ */
+
+#define TEST_NAME library_read_etc_passwd
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    setup_test(QUOTE(TEST_NAME));
+    dosiero_t *d = dosiero_open("rsrc/unix-v5-boot.img");
+    cr_assert(d != NULL, "Unable to open the image");
+    uint32_t ino = dosiero_resolve(d, "/etc/passwd");
+    cr_assert(ino != 0, "Unable to resolve /etc/passwd");
+    FILE *out = fopen(test_outfile, "w");
+    cr_assert(out != NULL, "Unable to open '%s'", test_outfile);
+    char buf[100];
+    uint64_t off = 0;
+    ssize_t n;
+    while ((n = dosiero_read(d, ino, buf, sizeof(buf), off)) > 0) {
+        fwrite(buf, 1, n, out);
+        off += n;
+    }
+    fclose(out);
+    dosiero_close(d);
+    cr_assert_eq(n, 0, "dosiero_read() failed at offset %llu", (unsigned long long)off);
+    // same bytes as -x -n /etc/passwd
+    assert_files_match(ref_outfile, test_outfile, NULL);
+}
+#undef TEST_NAME